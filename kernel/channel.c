@@ -0,0 +1,25 @@
+/*
+ * channels: message rings in shared memory segments. the kernel only sets a ring up;
+ * the endpoints attach the segment (shm_attach) and pass messages without syscalls, but
+ * for the futex doorbells rung when the other side sleeps.
+ */
+
+#include "channel.h"
+#include "shm.h"
+#include "spike_interface/spike_utils.h"
+
+//
+// implements chan_create syscall in kernel. returns the id of the segment holding the
+// ring, or -1 if no segment is left.
+//
+int chan_create(void) {
+  int id = shm_create(sizeof(chan_ring));
+  if (id < 0) return -1;
+
+  // the pages of a fresh segment are zeroed, set up the rest. the slot at position i of
+  // the first round is free for the sender of i.
+  chan_ring *ring = (chan_ring *)shm_page(id, 0);
+  ring->mask = CHAN_SLOTS - 1;
+  for (uint64 i = 0; i < CHAN_SLOTS; i++) ring->slots[i].seq = i;
+  return id;
+}
@@ -0,0 +1,40 @@
+/*
+ * layout of a channel: a bounded ring of messages in a page shared by its endpoints.
+ * this header is shared by the kernel (which sets the ring up) and the user library (which
+ * sends and receives without syscalls).
+ */
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include "util/types.h"
+
+#define CHAN_CACHELINE 64
+// number of message slots, a power of 2
+#define CHAN_SLOTS 128
+
+// a message slot. seq tells the round of the ring the slot is in (see user/user_lib.c).
+typedef struct chan_slot_t {
+  volatile uint64 seq;
+  uint64 msg;
+} chan_slot;
+
+// the fields written by different sides sit in separate cache lines
+typedef struct chan_ring_t {
+  // next position to send to, taken by the senders
+  volatile uint64 head __attribute__((aligned(CHAN_CACHELINE)));
+  // next position to receive from, owned by the (single) receiver
+  volatile uint64 tail __attribute__((aligned(CHAN_CACHELINE)));
+  // doorbell of the receiver, rung by senders only when it sleeps on an empty ring
+  volatile int data_bell __attribute__((aligned(CHAN_CACHELINE)));
+  volatile int receiver_waiting;
+  // doorbell of the senders, rung by the receiver only when some sleep on a full ring
+  volatile int space_bell __attribute__((aligned(CHAN_CACHELINE)));
+  volatile int senders_waiting;
+  uint64 mask __attribute__((aligned(CHAN_CACHELINE)));
+  chan_slot slots[CHAN_SLOTS] __attribute__((aligned(CHAN_CACHELINE)));
+} chan_ring;
+
+// create a channel, returns the id of the shared memory segment holding its ring
+int chan_create(void);
+
+#endif
@@ -8,35 +8,22 @@
 #include "riscv.h"
 #include "vmm.h"
 #include "pmm.h"
+#include "initramfs.h"
+#include "util/functions.h"
 #include "spike_interface/spike_utils.h"
 
-typedef struct elf_info_t {
-  spike_file_t *f;
-  struct process *p;
-} elf_info;
-
-//
-// the implementation of allocater. allocates memory space for later segment loading
-//
-static void *elf_alloc_mb(elf_ctx *ctx, uint64 elf_pa, uint64 elf_va, uint64 size) {
-  elf_info *msg = (elf_info *)ctx->info;
-  // We assume that size of proram segment is smaller than a page.
-  kassert(size < PGSIZE);
-  void *pa = alloc_page();
-  if (pa == 0) panic("uvmalloc mem alloc falied\n");
-
-  memset((void *)pa, 0, PGSIZE);
-  user_vm_map((pagetable_t)msg->p->pagetable, elf_va, PGSIZE, (uint64)pa,
-         prot_to_type(PROT_WRITE | PROT_READ | PROT_EXEC, 1));
-
-  return pa;
-}
-
 //
 // actual file reading, using the spike file interface.
 //
 static uint64 elf_fpread(elf_ctx *ctx, void *dest, uint64 nb, uint64 offset) {
   elf_info *msg = (elf_info *)ctx->info;
+  // the file is in memory already, no need to bother the host.
+  if (msg->rf) {
+    if (offset >= msg->rf->size) return 0;
+    if (nb > msg->rf->size - offset) nb = msg->rf->size - offset;
+    memcpy(dest, (char *)msg->rf->data + offset, nb);
+    return nb;
+  }
   // call spike file utility
   return spike_file_pread(msg->f, dest, nb, offset);
 }
@@ -57,107 +44,321 @@ elf_status elf_init(elf_ctx *ctx, void *info) {
 }
 
 //
-// load the elf segments to memory regions
+// read the program headers and the loadable segments of the elf into img. the content of
+// each segment is kept in its own pages: code pages are later mapped (shared) into every
+// process of the image, while data pages serve as the pristine copy for private pages.
 //
-elf_status elf_load(elf_ctx *ctx) {
-  elf_prog_header ph_addr;
-  int i, off;
-  // traverse the elf program segment headers
-  for (i = 0, off = ctx->ehdr.phoff; i < ctx->ehdr.phnum; i++, off += sizeof(ph_addr)) {
-    // read segment headers
-    if (elf_fpread(ctx, (void *)&ph_addr, sizeof(ph_addr), off) != sizeof(ph_addr)) return EL_EIO;
+elf_status elf_load(elf_ctx *ctx, elf_image *img) {
+  uint64 phsize = ctx->ehdr.phnum * sizeof(elf_prog_header);
+  if (phsize > PGSIZE) return EL_ERR;
 
-    if (ph_addr.type != ELF_PROG_LOAD) continue;
-    if (ph_addr.memsz < ph_addr.filesz) return EL_ERR;
-    if (ph_addr.vaddr + ph_addr.memsz < ph_addr.vaddr) return EL_ERR;
+  img->ehdr = ctx->ehdr;
+  if ((img->phdrs = (elf_prog_header *)alloc_page()) == 0) return EL_ENOMEM;
+  // read segment headers, all in one go
+  if (elf_fpread(ctx, img->phdrs, phsize, ctx->ehdr.phoff) != phsize) return EL_EIO;
+
+  // traverse the elf program segment headers
+  for (int i = 0; i < ctx->ehdr.phnum; i++) {
+    elf_prog_header *ph = &img->phdrs[i];
+
+    if (ph->type != ELF_PROG_LOAD) continue;
+    if (ph->memsz < ph->filesz) return EL_ERR;
+    if (ph->vaddr + ph->memsz < ph->vaddr) return EL_ERR;
+    if (img->nsegs >= MAX_ELF_SEGMENTS) return EL_ERR;
+
+    elf_segment *seg = &img->segs[img->nsegs++];
+    if (ph->flags == (SEGMENT_READABLE | SEGMENT_EXECUTABLE))
+      seg->seg_type = CODE_SEGMENT;
+    else if (ph->flags == (SEGMENT_READABLE | SEGMENT_WRITABLE))
+      seg->seg_type = DATA_SEGMENT;
+    else {
+      sprint("unknown program segment encountered, segment flag:%d.\n", ph->flags);
+      return EL_ERR;
+    }
 
     // allocate memory before loading
-    void *dest = elf_alloc_mb(ctx, ph_addr.vaddr, ph_addr.vaddr, ph_addr.memsz);
-
-    // actual loading
-    if (elf_fpread(ctx, dest, ph_addr.memsz, ph_addr.off) != ph_addr.memsz)
-      return EL_EIO;
-
-    // record the vm region in proc->mapped_info
-    int j;
-    for( j=0; j<PGSIZE/sizeof(mapped_region); j++ )
-      if( (process*)(((elf_info*)(ctx->info))->p)->mapped_info[j].va == 0x0 ) break;
-
-    ((process*)(((elf_info*)(ctx->info))->p))->mapped_info[j].va = ph_addr.vaddr;
-    ((process*)(((elf_info*)(ctx->info))->p))->mapped_info[j].npages = 1;
-    if( ph_addr.flags == (SEGMENT_READABLE|SEGMENT_EXECUTABLE) ){
-      ((process*)(((elf_info*)(ctx->info))->p))->mapped_info[j].seg_type = CODE_SEGMENT;
-      sprint( "CODE_SEGMENT added at mapped info offset:%d\n", j );
-    }else if ( ph_addr.flags == (SEGMENT_READABLE|SEGMENT_WRITABLE) ){
-      ((process*)(((elf_info*)(ctx->info))->p))->mapped_info[j].seg_type = DATA_SEGMENT;
-      sprint( "DATA_SEGMENT added at mapped info offset:%d\n", j );
-    }else
-      panic( "unknown program segment encountered, segment flag:%d.\n", ph_addr.flags );
-
-    ((process*)(((elf_info*)(ctx->info))->p))->total_mapped_region ++;
+    seg->va = ROUNDDOWN(ph->vaddr, PGSIZE);
+    seg->npages = (ROUNDUP(ph->vaddr + ph->memsz, PGSIZE) - seg->va) / PGSIZE;
+    if (seg->npages > PGSIZE / sizeof(uint64)) return EL_ERR;
+    if ((seg->pages = (uint64 *)alloc_zeroed_page()) == 0) return EL_ENOMEM;
+    for (int j = 0; j < seg->npages; j++) {
+      void *pa = alloc_zeroed_page();
+      if (pa == 0) return EL_ENOMEM;
+      seg->pages[j] = (uint64)pa;
+    }
+
+    // actual loading, page by page. the part beyond filesz (i.e., bss) stays zero.
+    for (uint64 off = 0; off < ph->filesz;) {
+      uint64 va = ph->vaddr + off;
+      uint64 len = MIN(ph->filesz - off, PGSIZE - (va & (PGSIZE - 1)));
+      char *dest = (char *)seg->pages[(va - seg->va) / PGSIZE] + (va & (PGSIZE - 1));
+      if (elf_fpread(ctx, dest, len, ph->off + off) != len) return EL_EIO;
+      off += len;
+    }
   }
 
   return EL_OK;
 }
 
+// cache of loaded elf images. launching a cached binary again costs no copying of code,
+// and no host I/O if it is in the initramfs (a stat of the host file otherwise).
+static elf_image elf_cache[ELF_CACHE_SIZE];
+static uint64 elf_cache_clock;
+
+//
+// drop the pages held by a (possibly partially loaded) cached image. processes that have
+// the image mapped keep their references to the code pages.
+//
+static void elf_image_release(elf_image *img) {
+  for (int i = 0; i < img->nsegs; i++) {
+    elf_segment *seg = &img->segs[i];
+    if (!seg->pages) continue;
+    for (int j = 0; j < seg->npages; j++)
+      if (seg->pages[j]) free_page((void *)seg->pages[j]);
+    free_page(seg->pages);
+  }
+  if (img->phdrs) free_page(img->phdrs);
+  memset(img, 0, sizeof(elf_image));
+}
+
+//
+// returns the image of the elf at "path", from the cache if it holds an image of the same
+// path and mtime, or else loads it into the cache (evicting the least recently used one).
+// returns NULL if the elf can not be loaded. the image stays valid till the next call.
+//
+elf_image *elf_image_get(const char *path) {
+  const ramfs_file *rf = initramfs_lookup(path);
+  uint64 mtime;
+
+  if (rf) {
+    mtime = rf->mtime;
+  } else {
+    struct stat st;
+    if (spike_file_statat(AT_FDCWD, path, &st) != 0) return NULL;
+    mtime = st.st_mtime;
+  }
+
+  elf_image *victim = &elf_cache[0];
+  for (int i = 0; i < ELF_CACHE_SIZE; i++) {
+    elf_image *img = &elf_cache[i];
+    if (img->phdrs && strcmp(img->path, path) == 0) {
+      if (img->mtime == mtime) {
+        img->last_use = ++elf_cache_clock;
+        return img;
+      }
+      // the file has changed since it was cached
+      elf_image_release(img);
+    }
+    if (img->last_use < victim->last_use) victim = img;
+  }
+
+  if (strlen(path) >= MAX_EXEC_PATH) return NULL;
+  elf_image_release(victim);
+
+  elf_ctx elfloader;
+  elf_info info;
+  if (elf_open(&elfloader, &info, path) != EL_OK) return NULL;
+  elf_status r = elf_load(&elfloader, victim);
+  elf_close(&elfloader);
+  if (r != EL_OK) {
+    elf_image_release(victim);
+    return NULL;
+  }
+
+  strcpy(victim->path, path);
+  victim->mtime = mtime;
+  victim->last_use = ++elf_cache_clock;
+  sprint("elf image %s is loaded into cache, %d segment(s).\n", path, victim->nsegs);
+  return victim;
+}
+
+//
+// free a chain of data page copies (see elf_image_copy_data).
+//
+static void elf_free_copies(void *copies) {
+  while (copies) {
+    void *next = *(void **)copies;
+    free_page(copies);
+    copies = next;
+  }
+}
+
+//
+// take the pages for the private copies of the data pages of img ahead of its mapping
+// (see elf_image_map_copies), so that the caller can back out before changing anything if
+// there is no memory for them. they are chained through their first word into *copies.
+// returns 0, or -1 if there is no memory.
+//
+int elf_image_copy_data(elf_image *img, void **copies) {
+  *copies = NULL;
+  for (int i = 0; i < img->nsegs; i++) {
+    if (img->segs[i].seg_type == CODE_SEGMENT) continue;
+    for (int j = 0; j < img->segs[i].npages; j++) {
+      void *copy = alloc_page();
+      if (copy == 0) {
+        elf_free_copies(*copies);
+        *copies = NULL;
+        return -1;
+      }
+      *(void **)copy = *copies;
+      *copies = copy;
+    }
+  }
+  return 0;
+}
+
+//
+// map the segments of a cached image into process p, and point it to the entry. code
+// pages are shared (no copy), each data page is a private copy of the cached one, made
+// in the pages taken by elf_image_copy_data().
+//
+void elf_image_map_copies(elf_image *img, process *p, void *copies) {
+  for (int i = 0; i < img->nsegs; i++) {
+    elf_segment *seg = &img->segs[i];
+    for (int j = 0; j < seg->npages; j++) {
+      uint64 pa = seg->pages[j];
+      if (seg->seg_type == CODE_SEGMENT) {
+        page_ref_inc((void *)pa);
+        user_vm_map(p->pagetable, seg->va + PGSIZE * j, PGSIZE, pa,
+                    prot_to_type(PROT_READ | PROT_EXEC, 1));
+      } else {
+        void *copy = copies;
+        copies = *(void **)copy;
+        memcpy(copy, (void *)pa, PGSIZE);
+        user_vm_map(p->pagetable, seg->va + PGSIZE * j, PGSIZE, (uint64)copy,
+                    prot_to_type(PROT_WRITE | PROT_READ, 1));
+      }
+    }
+
+    // record the vm region of the process
+    mapped_region *r = add_mapped_region(p, seg->va, seg->npages, seg->seg_type,
+                                         seg->seg_type == CODE_SEGMENT ? PROT_READ | PROT_EXEC
+                                                                       : PROT_READ | PROT_WRITE);
+    sprint("%s added at 0x%lx, in the region at 0x%lx\n",
+           seg->seg_type == CODE_SEGMENT ? "CODE_SEGMENT" : "DATA_SEGMENT", seg->va, r->va);
+  }
+
+  // entry (virtual) address
+  p->trapframe->epc = img->ehdr.entry;
+}
+
+//
+// map a cached image into process p (see elf_image_map_copies). returns 0, or -1 if there
+// is no memory for the data pages (then p is left as it is).
+//
+int elf_image_map(elf_image *img, process *p) {
+  void *copies;
+  if (elf_image_copy_data(img, &copies) != 0) return -1;
+  elf_image_map_copies(img, p, copies);
+  return 0;
+}
+
 typedef union {
   uint64 buf[MAX_CMDLINE_ARGS];
   char *argv[MAX_CMDLINE_ARGS];
 } arg_buf;
 
+// command line strings fetched from the host. the frontend stores the strings inside the
+// buffer as well, so it is kept for the whole lifetime of the kernel.
+static arg_buf g_arg_buf;
+// number of strings after PKE kernel in command line, -1 if not fetched yet.
+static long g_argc = -1;
+// number of leading "--" kernel options among them.
+static int g_kernel_opts;
+
 //
-// returns the number (should be 1) of string(s) after PKE kernel in command line.
-// and store the string(s) in arg_bug_msg.
+// returns the number (should be 1) of string(s) after PKE kernel and its options in
+// command line. the string(s) are kept in g_arg_buf, and fetched from the host only once.
 //
-static size_t parse_args(arg_buf *arg_bug_msg) {
-  // HTIFSYS_getmainvars frontend call reads command arguments to (input) *arg_bug_msg
-  long r = frontend_syscall(HTIFSYS_getmainvars, (uint64)arg_bug_msg,
-      sizeof(*arg_bug_msg), 0, 0, 0, 0, 0);
+static size_t parse_args(void) {
+  if (g_argc >= 0) return g_argc - g_kernel_opts;
+
+  // HTIFSYS_getmainvars frontend call reads command arguments to (input) g_arg_buf
+  long r = frontend_syscall(HTIFSYS_getmainvars, (uint64)&g_arg_buf,
+      sizeof(g_arg_buf), 0, 0, 0, 0, 0);
   kassert(r == 0);
 
-  size_t pk_argc = arg_bug_msg->buf[0];
-  uint64 *pk_argv = &arg_bug_msg->buf[1];
+  size_t pk_argc = g_arg_buf.buf[0];
+  uint64 *pk_argv = &g_arg_buf.buf[1];
 
   int arg = 1;  // skip the PKE OS kernel string, leave behind only the application name
   for (size_t i = 0; arg + i < pk_argc; i++)
-    arg_bug_msg->argv[i] = (char *)(uintptr_t)pk_argv[arg + i];
+    g_arg_buf.argv[i] = (char *)(uintptr_t)pk_argv[arg + i];
+  g_argc = pk_argc - arg;
+
+  // options of PKE kernel itself (e.g., "--initramfs=<file>") precede the application
+  for (g_kernel_opts = 0; g_kernel_opts < g_argc; g_kernel_opts++)
+    if (strncmp(g_arg_buf.argv[g_kernel_opts], "--", 2) != 0) break;
 
-  //returns the number of strings after PKE kernel in command line
-  return pk_argc - arg;
+  //returns the number of strings after PKE kernel and its options in command line
+  return g_argc - g_kernel_opts;
 }
 
 //
-// load the elf of user application, by using the spike file interface.
+// returns the value of kernel option "--<name>=<value>" in command line, or NULL if the
+// option is not given.
 //
-void load_bincode_from_host_elf(struct process *p) {
-  arg_buf arg_bug_msg;
+const char *get_kernel_option(const char *name) {
+  size_t len = strlen(name);
 
-  // retrieve command line arguements
-  size_t argc = parse_args(&arg_bug_msg);
-  if (!argc) panic("You need to specify the application program!\n");
+  parse_args();
+  for (int i = 0; i < g_kernel_opts; i++) {
+    char *opt = g_arg_buf.argv[i] + 2;
+    if (strncmp(opt, name, len) == 0 && opt[len] == '=') return opt + len + 1;
+  }
+  return NULL;
+}
 
-  sprint("Application: %s\n", arg_bug_msg.argv[0]);
+//
+// open the elf file at "path", from the initramfs if it holds the file, or else by
+// using the spike file interface. then init the elf loader (ctx) with it.
+//
+elf_status elf_open(elf_ctx *ctx, elf_info *info, const char *path) {
+  info->f = NULL;
+  info->rf = initramfs_lookup(path);
+  if (!info->rf) {
+    info->f = spike_file_open(path, O_RDONLY, 0);
+    if (IS_ERR_VALUE(info->f)) return EL_EIO;
+  }
 
-  //elf loading
-  elf_ctx elfloader;
-  elf_info info;
+  elf_status r = elf_init(ctx, info);
+  if (r != EL_OK) elf_close(ctx);
+  return r;
+}
 
-  info.f = spike_file_open(arg_bug_msg.argv[0], O_RDONLY, 0);
-  info.p = p;
-  if (IS_ERR_VALUE(info.f)) panic("Fail on openning the input application program.\n");
+//
+// release the file opened by elf_open.
+//
+void elf_close(elf_ctx *ctx) {
+  elf_info *info = (elf_info *)ctx->info;
+  // close host file
+  if (info->f) spike_file_close(info->f);
+  info->f = NULL;
+}
 
-  // init elfloader
-  if (elf_init(&elfloader, &info) != EL_OK)
-    panic("fail to init elfloader.\n");
+//
+// returns the strings after PKE kernel and its options in command line, i.e., the user
+// application(s) and their arguments. their number is returned in *argc.
+//
+char **get_app_cmdline(size_t *argc) {
+  *argc = parse_args();
+  return g_arg_buf.argv + g_kernel_opts;
+}
 
-  // load elf
-  if (elf_load(&elfloader) != EL_OK) panic("Fail on loading elf.\n");
+//
+// load the elf of a user application into process p, and pass argv[] (argc strings,
+// argv[0] names the elf) to its main().
+//
+void load_bincode_from_host_elf(struct process *p, int argc, char *argv[]) {
+  sprint("Application: %s\n", argv[0]);
 
-  // entry (virtual) address
-  p->trapframe->epc = elfloader.ehdr.entry;
+  //elf loading
+  elf_image *img = elf_image_get(argv[0]);
+  if (!img) panic("Fail on loading the input application program %s.\n", argv[0]);
+  if (elf_image_map(img, p) != 0) panic("No memory for application %s.\n", argv[0]);
 
-  // close host file
-  spike_file_close( info.f );
+  if (setup_user_args(p, argc, argv) != 0)
+    panic("Too many arguments for application %s.\n", argv[0]);
 
   sprint("Application program entry point (virtual address): 0x%lx\n", p->trapframe->epc);
 }
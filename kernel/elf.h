@@ -3,6 +3,8 @@
 
 #include "util/types.h"
 #include "process.h"
+#include "initramfs.h"
+#include "spike_interface/spike_file.h"
 
 #define MAX_CMDLINE_ARGS 64
 
@@ -55,14 +57,52 @@ typedef enum elf_status_t {
 
 } elf_status;
 
+// where an elf being loaded comes from
+typedef struct elf_info_t {
+  spike_file_t *f;
+  const ramfs_file *rf;  // set if the elf is held by the initramfs, f is unused then
+} elf_info;
+
 typedef struct elf_ctx_t {
   void *info;
   elf_header ehdr;
 } elf_ctx;
 
+// at most 8 loadable segments per elf, and 8 elf images in the cache
+#define MAX_ELF_SEGMENTS 8
+#define ELF_CACHE_SIZE 8
+
+// a loadable segment of a cached elf image
+typedef struct elf_segment_t {
+  uint64 va;        // page aligned starting virtual address
+  uint32 npages;    // number of pages covered by the segment
+  uint32 seg_type;  // CODE_SEGMENT or DATA_SEGMENT
+  uint64 *pages;    // a kernel page holding the physical pages of the segment content
+} elf_segment;
+
+// an elf loaded (and parsed) into memory, keyed by its path and mtime
+typedef struct elf_image_t {
+  char path[MAX_EXEC_PATH];
+  uint64 mtime;
+  uint64 last_use;         // for LRU eviction, 0 if the cache slot is empty
+  elf_header ehdr;
+  elf_prog_header *phdrs;  // program header table, kept in a kernel page
+  int nsegs;
+  elf_segment segs[MAX_ELF_SEGMENTS];
+} elf_image;
+
 elf_status elf_init(elf_ctx *ctx, void *info);
-elf_status elf_load(elf_ctx *ctx);
+elf_status elf_load(elf_ctx *ctx, elf_image *img);
+elf_status elf_open(elf_ctx *ctx, elf_info *info, const char *path);
+void elf_close(elf_ctx *ctx);
+
+elf_image *elf_image_get(const char *path);
+int elf_image_copy_data(elf_image *img, void **copies);
+void elf_image_map_copies(elf_image *img, process *p, void *copies);
+int elf_image_map(elf_image *img, process *p);
 
-void load_bincode_from_host_elf(process *p);
+void load_bincode_from_host_elf(process *p, int argc, char *argv[]);
+char **get_app_cmdline(size_t *argc);
+const char *get_kernel_option(const char *name);
 
 #endif
@@ -0,0 +1,79 @@
+/*
+ * futexes: the kernel half of user-space synchronization. a process sleeps on the address
+ * of an int in its vm space, till another process wakes it up through the same int.
+ *
+ * a futex is named by the physical address of the int, so that processes sharing the page
+ * (threads, or shared mappings at different virtual addresses) meet at the same futex.
+ * the sleeping processes are kept in a hash table of wait queues, linked by queue_next.
+ */
+
+#include "futex.h"
+#include "process.h"
+#include "sched.h"
+#include "vmm.h"
+#include "spike_interface/spike_utils.h"
+
+static process *futex_queues[FUTEX_HASH_SIZE];
+
+static process **futex_bucket(uint64 pa) {
+  // ints are 4-byte aligned, and neighbouring ints likely share a cache line
+  return &futex_queues[(pa >> 4) % FUTEX_HASH_SIZE];
+}
+
+//
+// translate the user address va of an int into its physical address, 0 if va is not
+// writable or misaligned. the page is faulted in for a write first (see user_va_access),
+// as a store of the waker would do: an untouched int would sit in the shared zero page,
+// and an int shared copy-on-write (e.g., after fork) would move to a private page at the
+// store, so the waiter and the waker would not meet at the same address.
+//
+static uint64 futex_pa(uint64 va) {
+  if (va & (sizeof(int) - 1)) return 0;
+  return (uint64)user_va_access(current->pagetable, va, 1);
+}
+
+//
+// implements futex_wait syscall in kernel: if the int at va still holds "expected", the
+// current process sleeps till futex_wake() on the int, and gets 0. returns -1 at once,
+// if the value has changed (or va is bad), so that the caller checks its condition again.
+//
+int futex_wait(uint64 va, int expected) {
+  uint64 pa = futex_pa(va);
+  if (!pa || *(volatile int *)pa != expected) return -1;
+
+  // join the tail of wait queue, to be woken up in FIFO order
+  process **pp = futex_bucket(pa);
+  while (*pp) pp = &(*pp)->queue_next;
+  *pp = current;
+  current->queue_next = NULL;
+
+  // the waker does not re-issue the syscall, so the return value is set beforehand.
+  current->trapframe->regs.a0 = 0;
+  sleep_on((void *)pa);
+  return 0;
+}
+
+//
+// implements futex_wake syscall in kernel: wakes up at most n processes waiting on the int
+// at va. returns the number of processes woken up, or -1 if va is bad.
+//
+int futex_wake(uint64 va, int n) {
+  uint64 pa = futex_pa(va);
+  if (!pa) return -1;
+
+  int woken = 0;
+  process **pp = futex_bucket(pa);
+  while (*pp && woken < n) {
+    process *p = *pp;
+    if (p->wait_chan != (void *)pa) {
+      pp = &p->queue_next;
+      continue;
+    }
+    *pp = p->queue_next;
+    // not in any queue now, as insert_to_ready_queue() expects
+    p->queue_next = NULL;
+    wakeup_process(p, (void *)pa);
+    woken++;
+  }
+  return woken;
+}
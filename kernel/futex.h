@@ -0,0 +1,14 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include "util/types.h"
+
+// number of buckets of the futex wait queues
+#define FUTEX_HASH_SIZE 64
+
+// block current process while the int at user address va holds the expected value
+int futex_wait(uint64 va, int expected);
+// wake up at most n processes waiting on the int at user address va
+int futex_wake(uint64 va, int n);
+
+#endif
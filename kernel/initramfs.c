@@ -0,0 +1,142 @@
+/*
+ * an in-memory initramfs, i.e., a cpio archive (in "newc" format) that is read from the
+ * host ONCE at boot time. afterwards, looking up and reading the files held by the archive
+ * costs no HTIF trip to the host.
+ *
+ * the archive is named in the command line as a kernel option, e.g.,
+ * $ spike ./obj/riscv-pke --initramfs=./obj/initramfs.cpio ./obj/app_wait
+ * and can be made by:
+ * $ ls ./obj/app_wait | cpio -o -H newc > ./obj/initramfs.cpio
+ */
+
+#include "initramfs.h"
+#include "elf.h"
+#include "pmm.h"
+#include "riscv.h"
+#include "string.h"
+#include "util/functions.h"
+#include "spike_interface/spike_utils.h"
+
+// layout of the "newc" cpio format: a 110 bytes header of ASCII hex fields, followed by
+// the path name and the file content, both padded to 4 bytes.
+#define CPIO_NEWC_MAGIC "070701"
+#define CPIO_HEADER_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+#define CPIO_FIELD(hdr, n) ((hdr) + 6 + 8 * (n))  // n-th 8-digit field after the magic
+#define CPIO_MODE 1
+#define CPIO_MTIME 5
+#define CPIO_FILESIZE 6
+#define CPIO_NAMESIZE 11
+
+#define CPIO_MODE_TYPE 0170000
+#define CPIO_MODE_REG 0100000
+
+// the archive as loaded in memory
+static char *g_archive;
+static uint64 g_archive_size;
+// table of regular files in the archive
+static ramfs_file *g_ramfs_files;
+static int g_ramfs_nfiles;
+
+static uint64 cpio_hex(const char *s) {
+  uint64 v = 0;
+  for (int i = 0; i < 8; i++) {
+    char c = s[i];
+    v <<= 4;
+    if (c >= '0' && c <= '9') v |= c - '0';
+    else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+  }
+  return v;
+}
+
+//
+// skip the leading "./" and "/" of a path name, so that "app", "./app" and "/app" match.
+//
+static const char *strip_path(const char *path) {
+  for (;;) {
+    if (path[0] == '/') path++;
+    else if (path[0] == '.' && path[1] == '/') path += 2;
+    else return path;
+  }
+}
+
+//
+// walk through the archive. records its regular files in g_ramfs_files, if "record" is
+// set. returns the number of regular files, or -1 if the archive is malformed.
+//
+static int cpio_scan(int record) {
+  uint64 off = 0;
+  int n = 0;
+
+  while (off + CPIO_HEADER_SIZE <= g_archive_size) {
+    char *hdr = g_archive + off;
+    if (strncmp(hdr, CPIO_NEWC_MAGIC, 6) != 0) return -1;
+
+    uint64 namesize = cpio_hex(CPIO_FIELD(hdr, CPIO_NAMESIZE));
+    uint64 filesize = cpio_hex(CPIO_FIELD(hdr, CPIO_FILESIZE));
+    char *name = hdr + CPIO_HEADER_SIZE;
+    uint64 data_off = ROUNDUP(off + CPIO_HEADER_SIZE + namesize, 4);
+    if (data_off + filesize > g_archive_size) return -1;
+
+    if (strcmp(name, CPIO_TRAILER) == 0) return n;
+
+    if ((cpio_hex(CPIO_FIELD(hdr, CPIO_MODE)) & CPIO_MODE_TYPE) == CPIO_MODE_REG) {
+      if (record) {
+        g_ramfs_files[n].name = strip_path(name);
+        g_ramfs_files[n].data = g_archive + data_off;
+        g_ramfs_files[n].size = filesize;
+        g_ramfs_files[n].mtime = cpio_hex(CPIO_FIELD(hdr, CPIO_MTIME));
+      }
+      n++;
+    }
+    off = ROUNDUP(data_off + filesize, 4);
+  }
+
+  // no trailer
+  return -1;
+}
+
+//
+// read the whole archive from the host into memory reserved right behind the kernel.
+// must be called before pmm_init(), as the memory is carved by pmm_boot_alloc().
+//
+void initramfs_init(void) {
+  const char *path = get_kernel_option("initramfs");
+  if (!path) return;
+
+  spike_file_t *f = spike_file_open(path, O_RDONLY, 0);
+  if (IS_ERR_VALUE(f)) panic("Fail on openning the initramfs %s.\n", path);
+
+  struct stat st;
+  if (spike_file_stat(f, &st) != 0) panic("Fail on querying the size of initramfs.\n");
+  g_archive_size = st.st_size;
+  g_archive = (char *)pmm_boot_alloc(g_archive_size);
+
+  // the host may return less than asked for, keep reading till the end of the archive
+  for (uint64 off = 0; off < g_archive_size;) {
+    ssize_t r = spike_file_pread(f, g_archive + off, g_archive_size - off, off);
+    if (r <= 0) panic("Fail on reading the initramfs.\n");
+    off += r;
+  }
+  spike_file_close(f);
+
+  int n = cpio_scan(0);
+  if (n < 0) panic("initramfs %s is not a cpio archive of newc format.\n", path);
+  g_ramfs_files = (ramfs_file *)pmm_boot_alloc(sizeof(ramfs_file) * n);
+  g_ramfs_nfiles = cpio_scan(1);
+
+  sprint("initramfs: %d file(s), 0x%lx bytes loaded from %s.\n", g_ramfs_nfiles,
+         g_archive_size, path);
+}
+
+//
+// look up a file in the initramfs. returns NULL if there is no initramfs, or the file
+// is not held by it.
+//
+const ramfs_file *initramfs_lookup(const char *path) {
+  path = strip_path(path);
+  for (int i = 0; i < g_ramfs_nfiles; i++)
+    if (strcmp(g_ramfs_files[i].name, path) == 0) return &g_ramfs_files[i];
+  return NULL;
+}
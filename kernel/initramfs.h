@@ -0,0 +1,19 @@
+#ifndef _INITRAMFS_H_
+#define _INITRAMFS_H_
+
+#include "util/types.h"
+
+// a (regular) file held by the in-memory initramfs
+typedef struct ramfs_file_t {
+  const char *name;  // path name inside the archive, without leading "./" or "/"
+  const void *data;  // file content, resides in memory reserved at boot
+  uint64 size;       // size of the file content in bytes
+  uint64 mtime;      // modification time recorded by the archive
+} ramfs_file;
+
+// load the archive named by "--initramfs=<host file>" into memory. called before pmm_init()
+void initramfs_init(void);
+// look up a file in the initramfs, returns NULL if it is not there
+const ramfs_file *initramfs_lookup(const char *path);
+
+#endif
@@ -5,6 +5,7 @@
 #include "riscv.h"
 #include "string.h"
 #include "elf.h"
+#include "initramfs.h"
 #include "process.h"
 #include "pmm.h"
 #include "vmm.h"
@@ -18,6 +19,9 @@
 //
 extern char trap_sec_start[];
 
+// separates the applications (with their arguments) in command line
+#define APP_DELIMITER "+"
+
 //
 // turn on paging.
 //
@@ -30,18 +34,38 @@ void enable_paging() {
 }
 
 //
-// load the elf, and construct a "process" (with only a trapframe).
+// load the elf(s) named in command line, each into a "process" of its own, and put them
+// into the ready queue. applications given with arguments are separated by "+", e.g.,
+// "app1 arg1 arg2 + app2 arg1", otherwise every string names an application.
 // load_bincode_from_host_elf is defined in elf.c
 //
-process* load_user_program( ) {
-  process* proc;
+void load_user_programs( ) {
+  size_t argc;
+  char **argv = get_app_cmdline(&argc);
+  if (!argc) panic("You need to specify the application program!\n");
+
+  int grouped = 0;
+  for (size_t i = 0; i < argc; i++)
+    if (strcmp(argv[i], APP_DELIMITER) == 0) grouped = 1;
 
-  proc = alloc_process();
+  for (size_t i = 0; i < argc; ) {
+    // the number of strings making up current application
+    size_t n = 1;
+    if (grouped)
+      for (n = 0; i + n < argc && strcmp(argv[i + n], APP_DELIMITER) != 0; n++)
+        ;
 
-  sprint("User application is loading.\n");
-  load_bincode_from_host_elf(proc);
+    if (n > 0) {
+      process* proc = alloc_process();
+      if (!proc) panic("cannot find any free process structure.\n");
+      sprint("User application is loading.\n");
+      load_bincode_from_host_elf(proc, n, argv + i);
+      insert_to_ready_queue(proc);
+    }
 
-  return proc;
+    // skip the delimiter as well
+    i += grouped ? n + 1 : n;
+  }
 }
 
 //
@@ -53,8 +77,14 @@ int s_start(void) {
   // but now switch to paging mode in lab2.
   write_csr(satp, 0);
 
+  // load the initramfs (if any) before the free page list is built, so that the archive
+  // can be placed in contiguous memory right behind the kernel image.
+  initramfs_init();
+
   // init phisical memory manager
   pmm_init();
+  // let the spike file interface grow its file and fd tables from now on
+  spike_file_set_allocator(alloc_page);
 
   // build the kernel page table
   kern_vm_init();
@@ -67,7 +97,7 @@ int s_start(void) {
 
   // the application code (elf) is first loaded into memory, and then put into execution
   sprint("Switch to user mode...\n");
-  insert_to_ready_queue( load_user_program() );
+  load_user_programs();
   schedule();
 
   return 0;
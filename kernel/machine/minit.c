@@ -109,6 +109,10 @@ void m_start(uintptr_t hartid, uintptr_t dtb) {
 
   timerinit(hartid);
 
+  // let S and U modes read the cycle, time and instret counters (e.g., for benchmarking).
+  write_csr(mcounteren, 0x7);
+  write_csr(scounteren, 0x7);
+
   // switch to supervisor mode and jump to s_start(), i.e., set pc to mepc
   asm volatile("mret");
 }
@@ -13,8 +13,17 @@
 
 // virtual address of stack top of user process
 #define USER_STACK_TOP 0x7ffff000
+// the user stack grows on demand (by page faults), by default down to this many pages.
+// the limit is per process (see stack_limit syscall), and is followed by a guard page.
+#define USER_STACK_MAX_PAGES 256
 
 // simple heap bottom, virtual address starts from 4MB
 #define USER_FREE_ADDRESS_START 0x00000000 + PGSIZE * 1024
 
+// the heap of a process grows from USER_FREE_ADDRESS_START up to USER_HEAP_LIMIT
+#define USER_HEAP_LIMIT 0x40000000
+// shared memory segments and anonymous mappings are placed from here, unless the process
+// chooses the address
+#define USER_MMAP_BASE USER_HEAP_LIMIT
+
 #endif
@@ -0,0 +1,222 @@
+/*
+ * anonymous memory mappings: mmap, munmap and mprotect. a mapping is recorded as an
+ * MMAP_SEGMENT region (with its protection), whose pages are zero-filled on demand by
+ * anon_fault(), or all at once with MAP_POPULATE. munmap and mprotect work on any page
+ * range, splitting the regions at its ends.
+ *
+ * madvise takes hints on any anonymous memory (heap and stack as well).
+ *
+ * a mapping of 2MB or more is placed at a 2MB boundary, so that it may be mapped by
+ * megapages (see anon_map_huge). they are split into pages wherever a range ends inside
+ * one of them.
+ */
+
+#include "mmap.h"
+#include "memlayout.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "riscv.h"
+#include "util/functions.h"
+#include "spike_interface/spike_utils.h"
+
+//
+// make va (a page boundary) the start of a region, if it is in the middle of one.
+//
+static void mmap_split_at(process *p, uint64 va)
+{
+  mapped_region *r = find_mapped_region(p, va);
+  if (r && r->va < va) split_mapped_region(p, r, va);
+}
+
+//
+// turn the byte range [va, va + len) into whole pages [va, *end). returns -1 if va is not
+// page aligned, or the range is empty or runs into the stack.
+//
+static int mmap_range(process *p, uint64 va, uint64 len, uint64 *end)
+{
+  if ((va & (PGSIZE - 1)) || len == 0 || len > USER_STACK_TOP) return -1;
+  *end = va + ROUNDUP(len, PGSIZE);
+  return *end > stack_guard(p) ? -1 : 0;
+}
+
+//
+// implements mmap syscall in kernel: maps len bytes of zero-filled memory with protection
+// prot at va of p, or at an address chosen by the kernel (above USER_MMAP_BASE) if va is
+// 0. the pages are faulted in at first touch, unless MAP_POPULATE is set in flags (then
+// by megapages where possible).
+// returns the address of the mapping, or -1 if it can not be made (or populated).
+//
+uint64 do_mmap(process *p, uint64 va, uint64 len, int prot, int flags)
+{
+  if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) return -1;
+  // there are no write-only pages
+  if (prot & PROT_WRITE) prot |= PROT_READ;
+
+  uint64 end;
+  if (va == 0) {
+    if (len == 0 || len > USER_STACK_TOP) return -1;
+    uint64 align = len >= HUGE_PGSIZE ? HUGE_PGSIZE : PGSIZE;
+    va = find_free_range(p, USER_MMAP_BASE, stack_guard(p), ROUNDUP(len, PGSIZE), align);
+    if (va == 0) return -1;
+  }
+  if (mmap_range(p, va, len, &end) != 0 || overlap_mapped_region(p, va, end)) return -1;
+
+  mapped_region *r = add_mapped_region(p, va, (end - va) / PGSIZE, MMAP_SEGMENT, prot);
+  if ((flags & MAP_POPULATE) && prot != PROT_NONE) {
+    // one batch, instead of a fault per page
+    for (uint64 a = va; a < end; a += PGSIZE) {
+      if ((a & (HUGE_PGSIZE - 1)) == 0 && anon_map_huge(p, r, a) == 0) {
+        a += HUGE_PGSIZE - PGSIZE;
+        continue;
+      }
+      if (anon_map_page(p, r, a, prot & PROT_WRITE) != 0) {
+        // out of memory: take the whole mapping back
+        remove_mapped_region(p, r);
+        user_vm_unmap(p->pagetable, va, end - va, 1);
+        return -1;
+      }
+    }
+  }
+  return va;
+}
+
+//
+// implements munmap syscall in kernel: unmaps the anonymous memory in the page range
+// [va, va + len) of p, and frees its pages. parts of the range that are not mapped are
+// skipped. returns 0, or -1 if the range is bad or overlaps memory not mapped by mmap, or
+// there is no memory to split a megapage at its ends.
+//
+int do_munmap(process *p, uint64 va, uint64 len)
+{
+  uint64 end;
+  if (mmap_range(p, va, len, &end) != 0) return -1;
+  mapped_region *r, *next;
+  for (r = overlap_mapped_region(p, va, end); r && r->va < end;
+       r = next_mapped_region(p, r->va + 1))
+    if (r->seg_type != MMAP_SEGMENT) return -1;
+
+  // the pages go first, as there may be no memory to split a megapage. the regions split
+  // are harmless then, the halves keep the same attributes.
+  mmap_split_at(p, va);
+  mmap_split_at(p, end);
+  if (user_vm_unmap(p->pagetable, va, end - va, 1) != 0) return -1;
+  for (r = next_mapped_region(p, va); r && r->va < end; r = next) {
+    next = next_mapped_region(p, r->va + 1);
+    remove_mapped_region(p, r);
+  }
+  return 0;
+}
+
+//
+// the leaf PTE bits of an anonymous page (or megapage, if "huge" is set) of protection
+// prot. PROT_NONE pages stay mapped, but out of reach of the user. a page that is shared
+// (the zero page, or a page shared with forked children) stays copy-on-write, whatever
+// the protection, so that it is never written in place: by a store of the user once it
+// is writable again, or by the kernel (see user_va_access) in the meantime.
+//
+static uint64 mmap_pte_flags(int prot, uint64 pa, int huge)
+{
+  uint64 flags = prot == PROT_NONE ? PTE_R | PTE_A : prot_to_type(prot, 1);
+  int refs = huge ? huge_page_ref_count((void *)pa) : page_ref_count((void *)pa);
+  if (refs > 1 || user_page_is_zero(pa)) flags = (flags & ~(PTE_W | PTE_D)) | PTE_COW;
+  return flags;
+}
+
+static int mprotect_leaf(pte_t *pte, uint64 va, int level, void *prot)
+{
+  *pte = PA2PTE(PTE2PA(*pte)) | mmap_pte_flags(*(int *)prot, PTE2PA(*pte), level > 0) | PTE_V;
+  return 0;
+}
+
+//
+// implements mprotect syscall in kernel: sets the protection of the anonymous memory in
+// the page range [va, va + len) of p to prot, for the pages mapped already and those to
+// be faulted in. returns 0, or -1 if the range is bad or not all mapped by mmap, or there
+// is no memory to split a megapage at its ends.
+//
+int do_mprotect(process *p, uint64 va, uint64 len, int prot)
+{
+  uint64 end;
+  if (mmap_range(p, va, len, &end) != 0 || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+    return -1;
+  if (prot & PROT_WRITE) prot |= PROT_READ;
+  // the whole range has to be mapped
+  for (uint64 a = va; a < end;) {
+    mapped_region *r = find_mapped_region(p, a);
+    if (!r || r->seg_type != MMAP_SEGMENT) return -1;
+    a = r->va + (uint64)r->npages * PGSIZE;
+  }
+
+  // a megapage partly in the range is split first, before anything is changed
+  if (user_vm_split(p->pagetable, va, end) != 0) return -1;
+  mmap_split_at(p, va);
+  mmap_split_at(p, end);
+  for (mapped_region *r = next_mapped_region(p, va); r && r->va < end;
+       r = next_mapped_region(p, r->va + 1))
+    r->prot = prot;
+
+  // in one walk over the pages mapped
+  walk_range(p->pagetable, va, end, mprotect_leaf, &prot);
+  return 0;
+}
+
+//
+// implements madvise syscall in kernel, on the anonymous memory (heap, stack or mmap) in
+// the page range [va, va + len) of p:
+// MADV_WILLNEED faults the pages in at once (writable ones as private pages), to take
+//   the faults out of the way of a hot loop. it is only a hint: it stops quietly where
+//   memory runs out, and the rest is left to faults.
+// MADV_DONTNEED frees the pages, they are zero-filled again at the next touch.
+// MADV_NORMAL, MADV_SEQUENTIAL and MADV_RANDOM set the access pattern that fault-around
+//   follows (see anon_fault), and MADV_HUGEPAGE/NOHUGEPAGE whether megapages may be
+//   faulted in (see anon_map_huge). the hint is kept by the regions of the range, which
+//   are split at its ends if they are mmap regions (and advised as a whole otherwise).
+// parts of the range that are not mapped are skipped. returns 0, or -1 if the range or
+// advice is bad, the range overlaps other memory, or there is no memory to split a
+// megapage at its ends (for MADV_DONTNEED).
+//
+int do_madvise(process *p, uint64 va, uint64 len, int advice)
+{
+  if ((va & (PGSIZE - 1)) || len == 0 || len > USER_STACK_TOP || advice < MADV_NORMAL ||
+      advice > MADV_NOHUGEPAGE)
+    return -1;
+  uint64 end = va + ROUNDUP(len, PGSIZE);
+  if (end > USER_STACK_TOP) return -1;
+  mapped_region *r;
+  for (r = overlap_mapped_region(p, va, end); r && r->va < end;
+       r = next_mapped_region(p, r->va + 1))
+    if (!anon_region(r)) return -1;
+
+  if (advice != MADV_WILLNEED && advice != MADV_DONTNEED) {
+    for (uint64 a = va; a < end; a += PGSIZE) {
+      if (!(r = find_mapped_region(p, a))) continue;
+      if (r->seg_type == MMAP_SEGMENT) {
+        uint64 r_end = r->va + (uint64)r->npages * PGSIZE;
+        mmap_split_at(p, a);
+        mmap_split_at(p, MIN(end, r_end));
+        r = find_mapped_region(p, a);
+      }
+      if (advice >= MADV_HUGEPAGE)
+        r->huge = advice;
+      else
+        r->advice = advice;
+      // on to the next region
+      a = r->va + (uint64)r->npages * PGSIZE - PGSIZE;
+    }
+    return 0;
+  }
+
+  if (advice == MADV_DONTNEED) return user_vm_unmap(p->pagetable, va, end - va, 1);
+
+  // MADV_WILLNEED
+  for (uint64 a = va; a < end; a += PGSIZE) {
+    if (!(r = find_mapped_region(p, a)) || r->prot == PROT_NONE) continue;
+    if ((a & (HUGE_PGSIZE - 1)) == 0 && a + HUGE_PGSIZE <= end && anon_map_huge(p, r, a) == 0) {
+      a += HUGE_PGSIZE - PGSIZE;
+      continue;
+    }
+    if (!leaf_walk(p->pagetable, a, 0) && anon_map_page(p, r, a, r->prot & PROT_WRITE) != 0)
+      break;
+  }
+  return 0;
+}
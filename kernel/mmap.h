@@ -0,0 +1,18 @@
+#ifndef _MMAP_H_
+#define _MMAP_H_
+
+#include "process.h"
+
+// flags of mmap: fault all the pages in at once
+#define MAP_POPULATE 0x1
+
+// map len bytes of anonymous memory at va (chosen by the kernel if 0) of p
+uint64 do_mmap(process *p, uint64 va, uint64 len, int prot, int flags);
+// unmap the anonymous memory in [va, va + len) of p
+int do_munmap(process *p, uint64 va, uint64 len);
+// change the protection of the anonymous memory in [va, va + len) of p
+int do_mprotect(process *p, uint64 va, uint64 len, int prot);
+// take a hint (MADV_* of vma.h) on the anonymous memory in [va, va + len) of p
+int do_madvise(process *p, uint64 va, uint64 len, int advice);
+
+#endif
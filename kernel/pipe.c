@@ -0,0 +1,270 @@
+/*
+ * pipes. a pipe buffers data in a ring of (at most PIPE_BUF_PAGES) pages.
+ *
+ * small or unaligned transfers are copied in and out of the buffer pages. but a full page
+ * written from a page-aligned user buffer is not copied: the page itself is queued, shared
+ * copy-on-write with the writer. likewise, such a page read into a page-aligned user buffer
+ * is mapped there (copy-on-write) in place of the page of the reader. so, large transfers
+ * only move page references, and no byte is copied unless one side writes to the page
+ * afterwards.
+ *
+ * reads and writes return as soon as some data is moved, and block only if nothing can be
+ * moved at all. the fds (open pipe ends) are owned by the thread group leader.
+ */
+
+#include "pipe.h"
+#include "pmm.h"
+#include "sched.h"
+#include "vmm.h"
+#include "riscv.h"
+#include "string.h"
+#include "util/functions.h"
+#include "spike_interface/spike_utils.h"
+
+// a page of buffered data: bytes [off, off+len) of the page are not read yet
+typedef struct pipe_buf_t {
+  void *page;
+  uint32 off, len;
+  // the page is shared copy-on-write with a user, never write to it
+  int shared;
+} pipe_buf;
+
+typedef struct pipe_t {
+  pipe_buf bufs[PIPE_BUF_PAGES];
+  int head, nbufs;  // ring of buffered pages
+  // number of open read / write ends, the pipe is unused if both are 0
+  int readers, writers;
+  // processes blocked on an empty / full pipe, linked by queue_next
+  process *read_waiters, *write_waiters;
+} pipe_t;
+
+static pipe_t pipes[MAX_PIPES];
+
+//
+// wake up all processes blocked on the pipe in list.
+//
+static void wake_all(process **list, pipe_t *pi) {
+  while (*list) {
+    process *p = *list;
+    *list = p->queue_next;
+    p->queue_next = NULL;
+    wakeup_process(p, pi);
+  }
+}
+
+//
+// block current on the pipe in list, the read or write is re-issued when woken up.
+//
+static void block_on(process **list, pipe_t *pi) {
+  current->queue_next = *list;
+  *list = current;
+  sleep_and_restart(pi);
+}
+
+//
+// the pipe open as fd of p (by its thread group), if the end is readable/writable as asked.
+//
+static pipe_t *fd_to_pipe(process *p, int fd, int writable) {
+  p = p->group;
+  if (fd < 0 || fd >= MAX_FDS || !p->fds[fd].pipe || p->fds[fd].writable != writable)
+    return NULL;
+  return p->fds[fd].pipe;
+}
+
+static int fd_alloc(process *p, pipe_t *pi, int writable) {
+  p = p->group;
+  for (int fd = 0; fd < MAX_FDS; fd++)
+    if (!p->fds[fd].pipe) {
+      p->fds[fd].pipe = pi;
+      p->fds[fd].writable = writable;
+      return fd;
+    }
+  return -1;
+}
+
+//
+// implements pipe syscall in kernel. returns 0, or -1 if no pipe or fd is left.
+//
+int do_pipe(process *p, uint64 fds_va) {
+  pipe_t *pi = NULL;
+  for (int i = 0; i < MAX_PIPES; i++)
+    if (pipes[i].readers == 0 && pipes[i].writers == 0) {
+      pi = &pipes[i];
+      break;
+    }
+  if (!pi) return -1;
+
+  int fds[2];
+  if ((fds[0] = fd_alloc(p, pi, 0)) < 0) return -1;
+  if ((fds[1] = fd_alloc(p, pi, 1)) < 0) {
+    p->group->fds[fds[0]].pipe = NULL;
+    return -1;
+  }
+  if (copy_to_user(p->pagetable, fds_va, fds, sizeof(fds)) != 0) {
+    p->group->fds[fds[0]].pipe = p->group->fds[fds[1]].pipe = NULL;
+    return -1;
+  }
+
+  memset(pi, 0, sizeof(pipe_t));
+  pi->readers = pi->writers = 1;
+  return 0;
+}
+
+//
+// implements read syscall in kernel, for the read end of a pipe. returns the number of
+// bytes read, 0 if the pipe is empty and has no writer (end of file), or -1 on failure.
+//
+int pipe_read(process *p, int fd, uint64 buf_va, uint64 n) {
+  pipe_t *pi = fd_to_pipe(p, fd, 0);
+  if (!pi) return -1;
+  if (n == 0) return 0;
+
+  if (pi->nbufs == 0) {
+    if (pi->writers == 0) return 0;
+    block_on(&pi->read_waiters, pi);
+  }
+
+  uint64 done = 0;
+  while (done < n && pi->nbufs > 0) {
+    pipe_buf *b = &pi->bufs[pi->head];
+    uint64 va = buf_va + done;
+
+    if (b->off == 0 && b->len == PGSIZE && (va & (PGSIZE - 1)) == 0 && n - done >= PGSIZE &&
+        user_page_install(p->pagetable, va, (uint64)b->page) == 0) {
+      // the page (and our reference of it) goes to the reader
+      done += PGSIZE;
+      b->len = 0;
+    } else {
+      uint64 len = MIN(n - done, b->len);
+      if (copy_to_user(p->pagetable, va, (char *)b->page + b->off, len) != 0) break;
+      done += len;
+      b->off += len;
+      b->len -= len;
+      if (b->len == 0) free_page(b->page);
+    }
+
+    if (b->len == 0) {
+      pi->head = (pi->head + 1) % PIPE_BUF_PAGES;
+      pi->nbufs--;
+    }
+  }
+
+  if (done > 0) wake_all(&pi->write_waiters, pi);
+  return done > 0 ? done : -1;
+}
+
+//
+// implements write syscall in kernel, for the write end of a pipe. returns the number of
+// bytes written, or -1 on failure (e.g., the pipe has no reader).
+//
+int pipe_write(process *p, int fd, uint64 buf_va, uint64 n) {
+  pipe_t *pi = fd_to_pipe(p, fd, 1);
+  if (!pi || pi->readers == 0) return -1;
+  if (n == 0) return 0;
+
+  // full, i.e., no free slot, and the last page has no room
+  pipe_buf *last = pi->nbufs ? &pi->bufs[(pi->head + pi->nbufs - 1) % PIPE_BUF_PAGES] : NULL;
+  if (pi->nbufs == PIPE_BUF_PAGES && (last->shared || last->off + last->len == PGSIZE))
+    block_on(&pi->write_waiters, pi);
+
+  uint64 done = 0;
+  while (done < n) {
+    uint64 va = buf_va + done;
+    uint64 len = n - done;
+    last = pi->nbufs ? &pi->bufs[(pi->head + pi->nbufs - 1) % PIPE_BUF_PAGES] : NULL;
+
+    // append to the last page, if it has room, unless a full page can be queued as it is
+    if (last && !last->shared && last->off + last->len < PGSIZE &&
+        (pi->nbufs == PIPE_BUF_PAGES || (va & (PGSIZE - 1)) != 0 || len < PGSIZE)) {
+      len = MIN(len, PGSIZE - last->off - last->len);
+      if (copy_from_user(p->pagetable, (char *)last->page + last->off + last->len, va, len) != 0)
+        break;
+      last->len += len;
+      done += len;
+      continue;
+    }
+
+    if (pi->nbufs == PIPE_BUF_PAGES) break;
+    pipe_buf *b = &pi->bufs[(pi->head + pi->nbufs) % PIPE_BUF_PAGES];
+    uint64 pa;
+
+    if ((va & (PGSIZE - 1)) == 0 && len >= PGSIZE && (pa = user_page_share(p->pagetable, va))) {
+      // queue the page itself
+      b->page = (void *)pa;
+      b->off = 0;
+      b->len = PGSIZE;
+      b->shared = 1;
+      done += PGSIZE;
+    } else {
+      if ((b->page = alloc_page()) == 0) break;
+      len = MIN(len, PGSIZE);
+      if (copy_from_user(p->pagetable, b->page, va, len) != 0) {
+        free_page(b->page);
+        break;
+      }
+      b->off = 0;
+      b->len = len;
+      b->shared = 0;
+      done += len;
+    }
+    pi->nbufs++;
+  }
+
+  if (done > 0) wake_all(&pi->read_waiters, pi);
+  return done > 0 ? done : -1;
+}
+
+//
+// drop an end of the pipe. the other side is woken up, to find the end of file (readers)
+// or the broken pipe (writers). buffered data goes with the last end.
+//
+static void pipe_release(pipe_t *pi, int writable) {
+  if (writable)
+    pi->writers--;
+  else
+    pi->readers--;
+  wake_all(&pi->read_waiters, pi);
+  wake_all(&pi->write_waiters, pi);
+
+  if (pi->readers == 0 && pi->writers == 0) {
+    for (; pi->nbufs > 0; pi->nbufs--) {
+      free_page(pi->bufs[pi->head].page);
+      pi->head = (pi->head + 1) % PIPE_BUF_PAGES;
+    }
+  }
+}
+
+//
+// implements close syscall in kernel. returns 0, or -1 if fd is not open.
+//
+int fd_close(process *p, int fd) {
+  p = p->group;
+  if (fd < 0 || fd >= MAX_FDS || !p->fds[fd].pipe) return -1;
+  pipe_release(p->fds[fd].pipe, p->fds[fd].writable);
+  p->fds[fd].pipe = NULL;
+  return 0;
+}
+
+//
+// fork: child gets the same open fds as parent.
+//
+void fd_dup_all(process *parent, process *child) {
+  parent = parent->group;
+  for (int fd = 0; fd < MAX_FDS; fd++) {
+    pipe_t *pi = parent->fds[fd].pipe;
+    child->fds[fd] = parent->fds[fd];
+    if (!pi) continue;
+    if (parent->fds[fd].writable)
+      pi->writers++;
+    else
+      pi->readers++;
+  }
+}
+
+//
+// exit: close every fd of p.
+//
+void fd_close_all(process *p) {
+  for (int fd = 0; fd < MAX_FDS; fd++)
+    if (p->fds[fd].pipe) fd_close(p, fd);
+}
@@ -0,0 +1,23 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+#include "process.h"
+
+// number of pipes in the system
+#define MAX_PIPES 64
+// capacity of a pipe, in pages of buffered data
+#define PIPE_BUF_PAGES 16
+
+// create a pipe, and store the fds of its read and write ends to user address fds_va
+int do_pipe(process *p, uint64 fds_va);
+// read from / write to an end of pipe
+int pipe_read(process *p, int fd, uint64 buf_va, uint64 n);
+int pipe_write(process *p, int fd, uint64 buf_va, uint64 n);
+// close a fd
+int fd_close(process *p, int fd);
+// let child share the open fds of parent
+void fd_dup_all(process *parent, process *child);
+// close all fds of p
+void fd_close_all(process *p);
+
+#endif
@@ -14,14 +14,32 @@ extern uint64 g_mem_size;
 
 static uint64 free_mem_start_addr;  //beginning address of free memory
 static uint64 free_mem_end_addr;    //end address of free memory (not included)
+static uint64 boot_alloc_top;       //end of the memory carved out by pmm_boot_alloc()
 
 typedef struct node {
-  struct node *next;
+  struct node *next, *prev;
 } list_node;
 
-// g_free_mem_list is the head of the list of free physical memory pages
+// g_free_mem_list is the head of the list of free physical memory pages. the list is
+// doubly linked, so that alloc_huge_page() can take pages out of its middle.
 static list_node g_free_mem_list;
 
+// pages zeroed ahead of time (see zero_pool_refill), so that alloc_zeroed_page() needs
+// not clear a page on the spot. they are allocated pages (of one reference), linked
+// through their first word, which is cleared when they are handed out.
+#define ZERO_POOL_MAX 64
+// number of pages zeroed by one zero_pool_refill(), to bound the work of a timer tick
+#define ZERO_POOL_BATCH 16
+static uint64 *zero_pool;
+static int zero_pool_len;
+
+// reference counts of the pages in [free_mem_start_addr, free_mem_end_addr), so that a
+// physical page can be mapped by several processes (e.g., the shared code pages).
+static uint16 *page_refs;
+#define PAGE_REF(pa) page_refs[((uint64)(pa) - free_mem_start_addr) / PGSIZE]
+// the reference count of a pinned page (see pin_page), which is never freed
+#define PAGE_REF_PINNED 0xffff
+
 //
 // actually creates the freepage list. each page occupies 4KB (PGSIZE)
 //
@@ -32,29 +50,182 @@ static void create_freepage_list(uint64 start, uint64 end) {
 }
 
 //
-// place a physical page at *pa to the free list of g_free_mem_list (to reclaim the page)
+// drop a reference to the physical page at *pa. when the last reference is gone, place
+// the page to the free list of g_free_mem_list (to reclaim the page)
 //
 void free_page(void *pa) {
   if (((uint64)pa % PGSIZE) != 0 || (uint64)pa < free_mem_start_addr || (uint64)pa >= free_mem_end_addr)
     panic("free_page 0x%lx \n", pa);
 
+  if (PAGE_REF(pa) == PAGE_REF_PINNED) return;
+  // the page is still in use by others
+  if (PAGE_REF(pa) > 1) {
+    PAGE_REF(pa)--;
+    return;
+  }
+  PAGE_REF(pa) = 0;
+
   // insert a physical page to g_free_mem_list
   list_node *n = (list_node *)pa;
   n->next = g_free_mem_list.next;
+  n->prev = &g_free_mem_list;
+  if (n->next) n->next->prev = n;
   g_free_mem_list.next = n;
 }
 
+//
+// take a free page out of g_free_mem_list.
+//
+static void unlink_free_page(list_node *n) {
+  n->prev->next = n->next;
+  if (n->next) n->next->prev = n->prev;
+  PAGE_REF(n) = 1;
+}
+
 //
 // takes the first free page from g_free_mem_list, and returns (allocates) it.
 // Allocates only ONE page!
 //
 void *alloc_page(void) {
   list_node *n = g_free_mem_list.next;
-  if (n) g_free_mem_list.next = n->next;
+  if (n) unlink_free_page(n);
+  // the pre-zeroed pages are the last resort
+  else if (zero_pool) return alloc_zeroed_page();
 
   return (void *)n;
 }
 
+//
+// allocates a page filled with zeroes: one zeroed in advance if there is any, otherwise
+// a free page cleared right now.
+//
+void *alloc_zeroed_page(void) {
+  uint64 *pa = zero_pool;
+  if (pa) {
+    zero_pool = (uint64 *)pa[0];
+    zero_pool_len--;
+    pa[0] = 0;
+    return pa;
+  }
+  if ((pa = alloc_page()) != 0) memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+//
+// drop the reference to a page which is all zero (e.g., an emptied page table). the page
+// is kept in the pool of pre-zeroed pages, if it is the last reference and the pool is
+// not full.
+//
+void free_zeroed_page(void *pa) {
+  if (zero_pool_len >= ZERO_POOL_MAX || page_ref_count(pa) != 1) {
+    free_page(pa);
+    return;
+  }
+  *(uint64 *)pa = (uint64)zero_pool;
+  zero_pool = pa;
+  zero_pool_len++;
+}
+
+//
+// top the pool of pre-zeroed pages up by a batch of (at most ZERO_POOL_BATCH) free pages.
+// called in the background, i.e., on timer ticks, out of the way of page faults, fork and
+// exec, which take their zeroed pages from the pool.
+//
+void zero_pool_refill(void) {
+  for (int i = 0; i < ZERO_POOL_BATCH && zero_pool_len < ZERO_POOL_MAX; i++) {
+    list_node *n = g_free_mem_list.next;
+    if (!n) return;
+    unlink_free_page(n);
+    memset(n, 0, PGSIZE);
+    free_zeroed_page(n);
+  }
+}
+
+//
+// allocates a megapage: HUGE_PGSIZE bytes of physically contiguous memory, aligned to its
+// size, by taking the pages of the first aligned block that is all free out of the free
+// list. each of the pages has a reference count of its own (of 1), and is given back by
+// free_page() on its own. returns NULL if memory is too fragmented.
+//
+void *alloc_huge_page(void) {
+  // the last page is not in the free list (see create_freepage_list)
+  for (uint64 block = ROUNDUP(free_mem_start_addr, HUGE_PGSIZE);
+       block + HUGE_PGSIZE < free_mem_end_addr; block += HUGE_PGSIZE) {
+    uint64 off;
+    for (off = 0; off < HUGE_PGSIZE; off += PGSIZE)
+      if (PAGE_REF(block + off)) break;
+    if (off < HUGE_PGSIZE) continue;
+
+    for (off = 0; off < HUGE_PGSIZE; off += PGSIZE) unlink_free_page((list_node *)(block + off));
+    return (void *)block;
+  }
+  return NULL;
+}
+
+//
+// take one more reference to an allocated physical page, which is going to be shared.
+//
+void page_ref_inc(void *pa) {
+  if (((uint64)pa % PGSIZE) != 0 || (uint64)pa < free_mem_start_addr || (uint64)pa >= free_mem_end_addr
+      || PAGE_REF(pa) == 0)
+    panic("page_ref_inc 0x%lx \n", pa);
+  if (PAGE_REF(pa) == PAGE_REF_PINNED) return;
+  if (PAGE_REF(pa) == PAGE_REF_PINNED - 1) panic("page_ref_inc: too many references to 0x%lx \n", pa);
+  PAGE_REF(pa)++;
+}
+
+//
+// pin an allocated page, which is going to be mapped any number of times (e.g., the
+// zero page): its reference count is saturated, so that references are no longer
+// counted, and the page is never freed.
+//
+void pin_page(void *pa) {
+  if (((uint64)pa % PGSIZE) != 0 || (uint64)pa < free_mem_start_addr || (uint64)pa >= free_mem_end_addr
+      || PAGE_REF(pa) == 0)
+    panic("pin_page 0x%lx \n", pa);
+  PAGE_REF(pa) = PAGE_REF_PINNED;
+}
+
+//
+// returns the number of references to an allocated physical page.
+//
+int page_ref_count(void *pa) { return PAGE_REF(pa); }
+
+//
+// take one more reference to each page of an allocated megapage (see alloc_huge_page).
+//
+void huge_page_ref_inc(void *pa) {
+  for (uint64 off = 0; off < HUGE_PGSIZE; off += PGSIZE) page_ref_inc((char *)pa + off);
+}
+
+//
+// returns the largest number of references to a page of an allocated megapage. its pages
+// are referenced alike while it is mapped as a whole, but not after it has been split in
+// some vm space.
+//
+int huge_page_ref_count(void *pa) {
+  int n = 0;
+  for (uint64 off = 0; off < HUGE_PGSIZE; off += PGSIZE) n = MAX(n, PAGE_REF((char *)pa + off));
+  return n;
+}
+
+//
+// carves "size" bytes of physically contiguous memory out of the space right behind the
+// PKE kernel image. only usable at boot time, i.e., before pmm_init() builds the free
+// page list; the carved out memory is never reclaimed.
+//
+void *pmm_boot_alloc(uint64 size) {
+  if (free_mem_end_addr) panic("pmm_boot_alloc is called after pmm_init.\n");
+
+  if (!boot_alloc_top) boot_alloc_top = ROUNDUP((uint64)&_end, PGSIZE);
+  uint64 start = boot_alloc_top;
+  boot_alloc_top += ROUNDUP(size, PGSIZE);
+  if (boot_alloc_top > DRAM_BASE + MIN(PKE_MAX_ALLOWABLE_RAM, g_mem_size))
+    panic("pmm_boot_alloc: no room for 0x%lx bytes.\n", size);
+
+  return (void *)start;
+}
+
 //
 // pmm_init() establishes the list of free physical pages according to available
 // physical memory space.
@@ -70,6 +241,12 @@ void pmm_init() {
 
   // free memory starts from the end of PKE kernel and must be page-aligined
   free_mem_start_addr = ROUNDUP(g_kernel_end , PGSIZE);
+  // skip the memory handed out by pmm_boot_alloc() (e.g., the initramfs)
+  if (boot_alloc_top > free_mem_start_addr) {
+    sprint("boot time reserved memory: [0x%lx, 0x%lx] \n", free_mem_start_addr,
+      boot_alloc_top - 1);
+    free_mem_start_addr = boot_alloc_top;
+  }
 
   // recompute g_mem_size to limit the physical memory space that PKE kernel
   // needs to manage
@@ -78,6 +255,12 @@ void pmm_init() {
     panic( "Error when recomputing physical memory size (g_mem_size).\n" );
 
   free_mem_end_addr = g_mem_size + DRAM_BASE;
+
+  // the page reference counts sit at the beginning of free memory
+  page_refs = (uint16 *)free_mem_start_addr;
+  uint64 refs_size = ROUNDUP((free_mem_end_addr - free_mem_start_addr) / PGSIZE * sizeof(uint16), PGSIZE);
+  memset(page_refs, 0, refs_size);
+  free_mem_start_addr += refs_size;
   sprint("free physical memory address: [0x%lx, 0x%lx] \n", free_mem_start_addr,
     free_mem_end_addr - 1);
 
@@ -1,11 +1,33 @@
 #ifndef _PMM_H_
 #define _PMM_H_
 
+#include "util/types.h"
+
 // Initialize phisical memeory manager
 void pmm_init();
 // Allocate a free phisical page
 void* alloc_page();
 // Free an allocated page
 void free_page(void* pa);
+// Allocate a phisical page filled with zeroes, from the pool of pre-zeroed pages if possible
+void* alloc_zeroed_page();
+// Free an allocated page known to be all zero, into the pool of pre-zeroed pages
+void free_zeroed_page(void* pa);
+// Zero some free pages ahead of time, called in the background (timer ticks)
+void zero_pool_refill();
+// Share an allocated page, i.e., take one more reference to it
+void page_ref_inc(void* pa);
+// Number of references to an allocated page
+int page_ref_count(void* pa);
+// Pin an allocated page, its references are no longer counted and it is never freed
+void pin_page(void* pa);
+// Share an allocated megapage, i.e., take one more reference to each of its pages
+void huge_page_ref_inc(void* pa);
+// Largest number of references to a page of an allocated megapage
+int huge_page_ref_count(void* pa);
+// Allocate HUGE_PGSIZE bytes of free phisical memory, aligned, i.e., a megapage
+void* alloc_huge_page();
+// Carve contiguous memory behind the kernel image, before pmm_init()
+void* pmm_boot_alloc(uint64 size);
 
 #endif
\ No newline at end of file
@@ -10,12 +10,15 @@
 #include "config.h"
 #include "elf.h"
 #include "memlayout.h"
+#include "pipe.h"
 #include "pmm.h"
+#include "shm.h"
 #include "riscv.h"
 #include "sched.h"
 #include "spike_interface/spike_utils.h"
 #include "strap.h"
 #include "string.h"
+#include "util/functions.h"
 #include "vmm.h"
 
 // Two functions defined in kernel/usertrap.S
@@ -31,11 +34,17 @@ extern char trap_sec_start[];
 // current points to the currently running user-mode application.
 process *current = NULL;
 
-// process pool
-process procs[NPROC];
+// process pool: a table of process structures in chunks of one page, indexed by the slot
+// part of pids.
+#define PROCS_PER_CHUNK (PGSIZE / sizeof(process))
+static process *proc_chunks[MAX_PROC_CHUNKS];
+static int nr_proc_chunks = 0;
+// FREE (and reaped) process structures, linked by queue_next
+static process *free_procs = NULL;
 
-// start virtual address of our simple heap.
-uint64 g_ufree_page = USER_FREE_ADDRESS_START;
+// exited processes whose trapframe and kernel stack are yet to be freed, linked by
+// queue_next.
+static process *reap_list = NULL;
 
 //
 // switch to a user-mode process
@@ -73,194 +82,859 @@ void switch_to(process *proc)
 }
 
 //
-// initialize process pool (the procs[] array)
+// add one chunk (page) of FREE process structures to the process table.
+// returns -1 if the table is at its largest, or there is no memory left.
 //
-void init_proc_pool()
+static int grow_proc_table()
 {
-  memset(procs, 0, sizeof(struct process) * NPROC);
-
-  for (int i = 0; i < NPROC; ++i) {
-    procs[i].status = FREE;
-    procs[i].pid = i;
+  if (nr_proc_chunks >= MAX_PROC_CHUNKS) return -1;
+  process *chunk = (process *)alloc_page();
+  if (!chunk) return -1;
+  memset(chunk, 0, PGSIZE);
+
+  uint64 first = nr_proc_chunks * PROCS_PER_CHUNK;
+  proc_chunks[nr_proc_chunks++] = chunk;
+  // push backwards, so that lower slots are handed out first
+  for (int i = PROCS_PER_CHUNK - 1; i >= 0; i--) {
+    chunk[i].status = FREE;
+    chunk[i].pid = first + i;
+    chunk[i].queue_next = free_procs;
+    free_procs = &chunk[i];
   }
+  return 0;
 }
 
 //
-// allocate an empty process, init its vm space. returns its pid
+// put a process structure back to the free list. it must be FREE, and have been reaped.
 //
-process *alloc_process()
+static void release_proc(process *p)
 {
-  // locate the first usable process structure
-  int i;
+  // the next user of the slot gets a fresh pid: same slot, next generation
+  uint64 gen = ((p->pid >> PID_SLOT_BITS) + 1) & ((1 << PID_GEN_BITS) - 1);
+  p->pid = (gen << PID_SLOT_BITS) | (p->pid & ((1 << PID_SLOT_BITS) - 1));
 
-  for (i = 0; i < NPROC; i++)
-    if (procs[i].status == FREE)
-      break;
+  p->queue_next = free_procs;
+  free_procs = p;
+}
 
-  if (i >= NPROC) {
-    panic("cannot find any free process structure.\n");
-    return 0;
-  }
+// the policy of transparent huge pages (see anon_map_huge)
+static int thp_policy = THP_MADVISE;
 
-  // init proc[i]'s vm space
-  procs[i].trapframe = (trapframe *)alloc_page(); // trapframe, used to save context
-  memset(procs[i].trapframe, 0, sizeof(trapframe));
+//
+// take the policy of transparent huge pages from kernel option "--thp=<policy>", where
+// the policy is always, madvise or never.
+//
+static void thp_init(void)
+{
+  const char *opt = get_kernel_option("thp");
+  if (!opt) return;
+  if (strcmp(opt, "always") == 0) thp_policy = THP_ALWAYS;
+  else if (strcmp(opt, "madvise") == 0) thp_policy = THP_MADVISE;
+  else if (strcmp(opt, "never") == 0) thp_policy = THP_NEVER;
+  else panic("unknown policy of transparent huge pages: %s.\n", opt);
+}
 
-  // page directory
-  procs[i].pagetable = (pagetable_t)alloc_page();
-  memset((void *)procs[i].pagetable, 0, PGSIZE);
+// pages mapped per fault on anonymous memory (see anon_fault)
+static int fault_around_pages = FAULT_AROUND_PAGES;
 
-  procs[i].kstack = (uint64)alloc_page() + PGSIZE; // user kernel stack top
-  uint64 user_stack = (uint64)alloc_page();        // phisical address of user stack bottom
-  procs[i].trapframe->regs.sp = USER_STACK_TOP;    // virtual address of user stack top
+//
+// take the fault-around window of new processes from kernel option
+// "--fault_around=<pages>", 1 (no fault-around) up to FAULT_AROUND_MAX.
+//
+static void fault_around_init(void)
+{
+  const char *opt = get_kernel_option("fault_around");
+  if (!opt) return;
+  int n = 0;
+  const char *c;
+  for (c = opt; *c >= '0' && *c <= '9' && n <= FAULT_AROUND_MAX; c++) n = n * 10 + (*c - '0');
+  if (*c || n < 1 || n > FAULT_AROUND_MAX) panic("bad fault-around window: %s.\n", opt);
+  fault_around_pages = n;
+}
 
-  // allocates a page to record memory regions (segments)
-  procs[i].mapped_info = (mapped_region *)alloc_page();
-  memset(procs[i].mapped_info, 0, PGSIZE);
+//
+// initialize process pool (the process table)
+//
+void init_proc_pool()
+{
+  memset(proc_chunks, 0, sizeof(proc_chunks));
+  nr_proc_chunks = 0;
+  free_procs = NULL;
+  if (grow_proc_table() != 0) panic("fail to allocate the process table.\n");
+  thp_init();
+  fault_around_init();
+}
+
+//
+// look up the process of pid. the slot part of pid locates the process structure, and
+// the whole pid must match, so that a stale pid (of a reused slot) finds nothing.
+//
+process *find_process(int pid)
+{
+  if (pid < 0) return NULL;
+  uint64 slot = pid & ((1 << PID_SLOT_BITS) - 1);
+  if (slot >= nr_proc_chunks * PROCS_PER_CHUNK) return NULL;
+
+  process *p = &proc_chunks[slot / PROCS_PER_CHUNK][slot % PROCS_PER_CHUNK];
+  if (p->pid != pid || p->status == FREE) return NULL;
+  return p;
+}
+
+//
+// take a process structure from the pool, with a fresh trapframe and kernel stack but no
+// vm space. returns NULL if there is no free process structure.
+//
+static process *alloc_proc_struct()
+{
+  reap_processes();
+  // take a structure from the free list, grow the table if it runs out
+  if (!free_procs && grow_proc_table() != 0) {
+    sprint("cannot find any free process structure.\n");
+    return NULL;
+  }
+  process *p = free_procs;
+  free_procs = p->queue_next;
+
+  p->queue_next = NULL;
+  p->parent = p->children = p->sibling = NULL;
+  p->group = p;
+  p->threads = p->joiner = NULL;
+  p->nr_threads = 0;
+  p->wait_chan = NULL;
+  p->exit_code = 0;
+  p->tick_count = 0;
+  p->heap_top = 0;
+  p->regions = NULL;
+  p->total_mapped_region = 0;
+  p->fault_around = p->fault_window = fault_around_pages;
+  p->fault_next = 0;
+  p->stack_limit = USER_STACK_MAX_PAGES;
+  memset(p->fds, 0, sizeof(p->fds));
+
+  p->trapframe = (trapframe *)alloc_page(); // trapframe, used to save context
+  memset(p->trapframe, 0, sizeof(trapframe));
+  p->kstack = (uint64)alloc_page() + PGSIZE; // user kernel stack top
+  return p;
+}
+
+//
+// allocate an empty process, init its vm space. returns NULL if there is no free process
+// structure.
+//
+process *alloc_process()
+{
+  process *p = alloc_proc_struct();
+  if (!p) return NULL;
+
+  // init the process's vm space, starting from the page directory
+  // zeroed pages come from the pool filled in the background (see zero_pool_refill)
+  p->pagetable = (pagetable_t)alloc_zeroed_page();
+
+  uint64 user_stack = (uint64)alloc_zeroed_page();  // phisical address of user stack bottom
+  p->trapframe->regs.sp = USER_STACK_TOP;    // virtual address of user stack top
 
   // map user stack in userspace
-  user_vm_map((pagetable_t)procs[i].pagetable, USER_STACK_TOP - PGSIZE, PGSIZE,
+  user_vm_map((pagetable_t)p->pagetable, USER_STACK_TOP - PGSIZE, PGSIZE,
               user_stack, prot_to_type(PROT_WRITE | PROT_READ, 1));
-  procs[i].mapped_info[0].va = USER_STACK_TOP - PGSIZE;
-  procs[i].mapped_info[0].npages = 1;
-  procs[i].mapped_info[0].seg_type = STACK_SEGMENT;
+  add_mapped_region(p, USER_STACK_TOP - PGSIZE, 1, STACK_SEGMENT, PROT_READ | PROT_WRITE);
 
   // map trapframe in user space (direct mapping as in kernel space).
-  user_vm_map((pagetable_t)procs[i].pagetable, (uint64)procs[i].trapframe, PGSIZE,
-              (uint64)procs[i].trapframe, prot_to_type(PROT_WRITE | PROT_READ, 0));
-  procs[i].mapped_info[1].va = (uint64)procs[i].trapframe;
-  procs[i].mapped_info[1].npages = 1;
-  procs[i].mapped_info[1].seg_type = CONTEXT_SEGMENT;
+  user_vm_map((pagetable_t)p->pagetable, (uint64)p->trapframe, PGSIZE,
+              (uint64)p->trapframe, prot_to_type(PROT_WRITE | PROT_READ, 0));
+  add_mapped_region(p, (uint64)p->trapframe, 1, CONTEXT_SEGMENT, PROT_READ | PROT_WRITE);
 
   // map S-mode trap vector section in user space (direct mapping as in kernel space)
   // we assume that the size of usertrap.S is smaller than a page.
-  user_vm_map((pagetable_t)procs[i].pagetable, (uint64)trap_sec_start, PGSIZE,
+  user_vm_map((pagetable_t)p->pagetable, (uint64)trap_sec_start, PGSIZE,
               (uint64)trap_sec_start, prot_to_type(PROT_READ | PROT_EXEC, 0));
-  procs[i].mapped_info[2].va = (uint64)trap_sec_start;
-  procs[i].mapped_info[2].npages = 1;
-  procs[i].mapped_info[2].seg_type = SYSTEM_SEGMENT;
+  add_mapped_region(p, (uint64)trap_sec_start, 1, SYSTEM_SEGMENT, PROT_READ | PROT_EXEC);
 
   sprint("in alloc_proc. user frame 0x%lx, user stack 0x%lx, user kstack 0x%lx \n",
-         procs[i].trapframe, procs[i].trapframe->regs.sp, procs[i].kstack);
+         p->trapframe, p->trapframe->regs.sp, p->kstack);
 
-  procs[i].total_mapped_region = 3;
   // return after initialization.
-  return &procs[i];
+  return p;
+}
+
+//
+// implements sbrk syscall in kernel: moves the program break (the end of heap) of p by
+// incr bytes, and returns the old one, or -1 if the heap can not be grown (or shrunk) so.
+// a grown heap takes no physical page: pages are zero-filled at the first touch (see
+// anon_fault), so a large growth costs one syscall, whatever its size.
+//
+uint64 do_sbrk(process *p, int64 incr)
+{
+  p = p->group;
+  if (!p->heap_top) p->heap_top = USER_FREE_ADDRESS_START;
+
+  uint64 old_top = p->heap_top, new_top = old_top + incr;
+  if (new_top < USER_FREE_ADDRESS_START || new_top > USER_HEAP_LIMIT) return -1;
+
+  mapped_region *heap = next_mapped_region(p, USER_FREE_ADDRESS_START);
+  if (!heap || heap->seg_type != HEAP_SEGMENT)
+    heap = add_mapped_region(p, USER_FREE_ADDRESS_START, 0, HEAP_SEGMENT,
+                             PROT_READ | PROT_WRITE);
+
+  uint64 old_end = ROUNDUP(old_top, PGSIZE), new_end = ROUNDUP(new_top, PGSIZE);
+  // the range must not run into the next region (e.g., shared memory attached at a fixed
+  // address)
+  mapped_region *next = next_mapped_region(p, heap->va + 1);
+  if (new_end > old_end && next && next->va < new_end) return -1;
+  // a shrunk heap gives its pages back
+  if (new_end < old_end && user_vm_unmap(p->pagetable, new_end, old_end - new_end, 1) != 0)
+    return -1;
+
+  heap->npages = (new_end - USER_FREE_ADDRESS_START) / PGSIZE;
+  p->heap_top = new_top;
+  return old_top;
+}
+
+//
+// the lowest address reserved for the user stack of p: the guard page, right below the
+// stack_limit pages the stack may grow to. the guard page is never mapped, so that an
+// overflow faults instead of running into other memory, and no other region is placed
+// above it.
+//
+uint64 stack_guard(process *p)
+{
+  return USER_STACK_TOP - (uint64)(p->group->stack_limit + 1) * PGSIZE;
 }
 
 //
-// reclaim a process
+// implements stack_limit syscall in kernel: sets the limit of the user stack of p to
+// npages pages, unless npages is 0. returns the old limit, or -1 if the stack is deeper
+// than npages already, or the reservation (the guard page included) would run into
+// another region, or the heap.
+//
+int set_stack_limit(process *p, int npages)
+{
+  process *vm = p->group;
+  int old = vm->stack_limit;
+  if (npages == 0) return old;
+  if (npages < 0 || npages >= (USER_STACK_TOP - USER_HEAP_LIMIT) / PGSIZE) return -1;
+
+  uint64 guard = USER_STACK_TOP - (uint64)(npages + 1) * PGSIZE;
+  mapped_region *stack = find_mapped_region(vm, USER_STACK_TOP - PGSIZE);
+  if (stack->va <= guard || overlap_mapped_region(vm, guard, stack->va)) return -1;
+  vm->stack_limit = npages;
+  return old;
+}
+
+//
+// extend the stack region of p down to the page of va, if va is below the stack but
+// above its guard page (see stack_guard), and no other region is in between. returns the
+// stack region, or NULL if va is not a stack address.
+//
+static mapped_region *stack_grow(process *p, uint64 va)
+{
+  process *vm = p->group;
+  uint64 bottom = ROUNDDOWN(va, PGSIZE), guard = stack_guard(p);
+  if (va >= USER_STACK_TOP || bottom < guard) return NULL;
+  if (bottom == guard) {
+    sprint("process %d: stack overflow at 0x%lx (limit %d pages).\n", p->pid, va,
+           vm->stack_limit);
+    return NULL;
+  }
+
+  mapped_region *stack = find_mapped_region(vm, USER_STACK_TOP - PGSIZE);
+  if (!stack || overlap_mapped_region(vm, bottom, stack->va)) return NULL;
+  // moving the start of the stack down keeps the order of the regions, as there is none
+  // in between.
+  stack->npages += (stack->va - bottom) / PGSIZE;
+  stack->va = bottom;
+  return stack;
+}
+
+//
+// map a zero-filled megapage at the aligned 2MB block of va, in anonymous region r of p
+// (so that a large array takes a single TLB entry, and one fault), if:
+// the policy allows it for r: under THP_MADVISE, r has to be advised MADV_HUGEPAGE (and
+//   MADV_NOHUGEPAGE keeps r out of it under THP_ALWAYS). the stack is never mapped so.
+// the block lies in r as a whole, and nothing of it is mapped yet (not even a page table
+//   is there).
+// a megapage is contiguous in physical memory, so it may not be found either. returns 0
+// if done, or -1 if the block is left to single pages.
+//
+int anon_map_huge(process *p, mapped_region *r, uint64 va)
+{
+  if (r->seg_type == STACK_SEGMENT || r->prot == PROT_NONE || thp_policy == THP_NEVER ||
+      r->huge == MADV_NOHUGEPAGE || (thp_policy == THP_MADVISE && r->huge != MADV_HUGEPAGE))
+    return -1;
+  uint64 block = ROUNDDOWN(va, HUGE_PGSIZE);
+  if (block < r->va || block + HUGE_PGSIZE > r->va + (uint64)r->npages * PGSIZE) return -1;
+  pte_t *pte = huge_walk(p->pagetable, block, 1);
+  if (!pte || (*pte & PTE_V)) return -1;
+
+  void *pa = alloc_huge_page();
+  if (!pa) return -1;
+  memset(pa, 0, HUGE_PGSIZE);
+  *pte = PA2PTE(pa) | prot_to_type(r->prot, 1) | PTE_V;
+  return 0;
+}
+
+//
+// map the anonymous page at va (not mapped yet) of region r of p, zero-filled: a private
+// page if "private" is set, or else the shared zero page, copy-on-write. returns 0, or -1
+// if there is no memory for the page (or its page table).
+//
+int anon_map_page(process *p, mapped_region *r, uint64 va, int private)
+{
+  if (!private)
+    return map_pages((pagetable_t)p->pagetable, va, PGSIZE, user_zero_page(),
+                     prot_to_type(r->prot & ~PROT_WRITE, 1) | PTE_COW);
+  void *pa = alloc_zeroed_page();
+  if (!pa) return -1;
+  if (map_pages((pagetable_t)p->pagetable, va, PGSIZE, (uint64)pa, prot_to_type(r->prot, 1)) != 0) {
+    free_page(pa);
+    return -1;
+  }
+  return 0;
+}
+
+//
+// is region r of anonymous memory, i.e., zero-filled on demand?
+//
+int anon_region(mapped_region *r)
+{
+  return r->seg_type == HEAP_SEGMENT || r->seg_type == STACK_SEGMENT ||
+         r->seg_type == MMAP_SEGMENT;
+}
+
+//
+// a page fault at va of p, in anonymous memory (heap, stack or mmap) not mapped yet.
+// such memory is zero-filled on demand: a load maps the shared zero page copy-on-write
+// (so a later store takes a private copy), while a store maps a private zeroed page at
+// once. returns 0 if done, or -1 if it is not such a fault or there is no memory for the
+// page (then the page fault handler kills p).
+//
+// the untouched neighbours of va in the region are mapped as well (fault-around), to
+// save their faults: the fault_around pages (aligned) around va, which are given the zero
+// page. if the fault is where the previous one stopped, p is running through the region
+// sequentially, and the window lies ahead of va instead, doubling up to FAULT_AROUND_MAX
+// pages. the pages of such a stream are made private at a store. the advice of the
+// region (see madvise) overrides the guess: a MADV_SEQUENTIAL region is streamed with
+// the largest window at once, while a MADV_RANDOM one is faulted in page by page. the
+// neighbours are only a guess, so the window stops at the first one there is no memory
+// for; only the page of va itself has to be mapped.
+//
+// all of that is skipped if the whole 2MB block of va can be mapped by a megapage (see
+// anon_map_huge), which is then taken at a load as well, instead of the zero page.
+//
+int anon_fault(process *p, uint64 va, int store)
+{
+  process *vm = p->group;
+  mapped_region *r = find_mapped_region(p, va);
+  if (!r) r = stack_grow(p, va);
+  if (!r) return -1;
+  // the protection of the region has to allow the access
+  if (!anon_region(r) || r->prot == PROT_NONE || (store && !(r->prot & PROT_WRITE))) return -1;
+  if (leaf_walk(p->pagetable, va, 0)) return -1;
+  if (anon_map_huge(p, r, va) == 0) return 0;
+
+  uint64 page = ROUNDDOWN(va, PGSIZE), start, end;
+  int stream = page == vm->fault_next || r->advice == MADV_SEQUENTIAL;
+  if (r->advice == MADV_RANDOM) {
+    vm->fault_window = 1;
+    start = page;
+  } else if (r->advice == MADV_SEQUENTIAL) {
+    vm->fault_window = FAULT_AROUND_MAX;
+    start = page;
+  } else if (stream) {
+    vm->fault_window = MIN(vm->fault_window * 2, FAULT_AROUND_MAX);
+    start = page;
+  } else {
+    vm->fault_window = vm->fault_around;
+    start = ROUNDDOWN(page, vm->fault_window * PGSIZE);
+  }
+  end = start + vm->fault_window * PGSIZE;
+  start = MAX(start, r->va);
+  end = MIN(end, r->va + (uint64)r->npages * PGSIZE);
+
+  if (anon_map_page(p, r, page, store) != 0) {
+    sprint("process %d: out of memory for the anonymous page at 0x%lx.\n", p->pid, page);
+    return -1;
+  }
+  for (uint64 a = start; a < end; a += PGSIZE) {
+    if (a == page || leaf_walk(p->pagetable, a, 0)) continue;
+    if (anon_map_page(p, r, a, store && stream) != 0) break;
+  }
+  vm->fault_next = end;
+  return 0;
+}
+
+//
+// reclaim a process. its user vm space (user pages, page tables and vm regions) is
+// destructed at once (unless proc is a thread), as the kernel runs on the kernel page
+// table. but proc can be current process, whose user kernel stack is in use, so its
+// trapframe and kernel stack are left to reap_processes().
 //
 int free_process(process *proc)
 {
-  // we set the status to ZOMBIE, but cannot destruct its vm space immediately.
-  // since proc can be current process, and its user kernel stack is currently in use!
-  // but for proxy kernel, it (memory leaking) may NOT be a really serious issue,
-  // as it is different from regular OS, which needs to run 7x24.
   proc->status = ZOMBIE;
 
+  if (proc->group != proc) {
+    // a thread only drops its trapframe from the vm space of the group
+    user_vm_unmap(proc->pagetable, (uint64)proc->trapframe, PGSIZE, 0);
+  } else {
+    // the pages of shared segments go with the page table, as for any other user page.
+    // anonymous mappings are unmapped first, as their PROT_NONE pages are no user pages.
+    mapped_region *r;
+    for (r = next_mapped_region(proc, 0); r; r = next_mapped_region(proc, r->va + 1)) {
+      if (r->seg_type == SHARED_SEGMENT) shm_release_region(proc, r);
+      if (r->seg_type == MMAP_SEGMENT)
+        user_vm_unmap(proc->pagetable, r->va, (uint64)r->npages * PGSIZE, 1);
+    }
+    user_vm_teardown(proc->pagetable);
+    free_mapped_regions(proc);
+  }
+  proc->pagetable = NULL;
+
+  proc->queue_next = reap_list;
+  reap_list = proc;
+
   return 0;
 }
 
 //
-// implements fork syscal in kernel.
-// basic idea here is to first allocate an empty process (child), then duplicate the
-// context and data segments of parent process to the child, and lastly, map other
-// segments (code, system) of the parent to child. the stack segment remains unchanged
-// for the child.
+// free the trapframe and kernel stack of exited processes. it is called on trap entry and
+// before a process structure is allocated, i.e., running on the kernel stack of current,
+// which is kept in reap_list if it has exited as well.
 //
-int do_fork(process *parent)
+void reap_processes()
 {
-  sprint("will fork a child from parent %d.\n", parent->pid);
-  process *child = alloc_process();
+  process **pp = &reap_list;
 
-  for (int i = 0; i < parent->total_mapped_region; i++) {
-    // browse parent's vm space, and copy its trapframe and data segments,
-    // map its code segment.
-    switch (parent->mapped_info[i].seg_type) {
+  while (*pp) {
+    process *p = *pp;
+    if (p == current) {
+      pp = &p->queue_next;
+      continue;
+    }
+    *pp = p->queue_next;
+    p->queue_next = NULL;
+    free_page(p->trapframe);
+    p->trapframe = NULL;
+    free_page((void *)(p->kstack - PGSIZE));
+    p->kstack = 0;
+    // the parent may have reaped it already
+    if (p->status == FREE) release_proc(p);
+  }
+}
+
+//
+// make child a child of parent.
+//
+void add_child(process *parent, process *child)
+{
+  child->parent = parent;
+  child->sibling = parent->children;
+  parent->children = child;
+}
+
+//
+// duplicate the vm space of parent into each of the n (freshly allocated) children.
+// the parent's vm space is browsed only once, and the pages of each region are walked
+// once for all the children (see user_vm_fork), visiting only those mapped: its
+// trapframe and data segments are copied to every child, its stack, heap and mmap pages
+// are shared copy-on-write, while its code and shared segments are mapped into every
+// child.
+//
+static void fork_vm_space(process *parent, process *children[], int n)
+{
+  // parent may be a thread, whose regions are booked in the group leader
+  process *vm = parent->group;
+  pagetable_t pts[MAX_FORK_N];
+  for (int k = 0; k < n; k++) {
+    pts[k] = children[k]->pagetable;
+    children[k]->fault_around = vm->fault_around;
+    children[k]->stack_limit = vm->stack_limit;
+  }
+  for (mapped_region *r = next_mapped_region(vm, 0); r; r = next_mapped_region(vm, r->va + 1)) {
+    uint64 size = (uint64)r->npages * PGSIZE;
+    switch (r->seg_type) {
     case CONTEXT_SEGMENT:
-      *child->trapframe = *parent->trapframe;
+      for (int k = 0; k < n; k++) *children[k]->trapframe = *parent->trapframe;
       break;
     case STACK_SEGMENT:
-      memcpy((void *)lookup_pa(child->pagetable, child->mapped_info[0].va),
-             (void *)lookup_pa(parent->pagetable, parent->mapped_info[i].va), PGSIZE);
+      // every page the stack has grown to, not only the one set up by alloc_process().
+      // the pages are shared copy-on-write, and those untouched so far remain to be
+      // zero-filled.
+      user_vm_fork(parent->pagetable, pts, n, r->va, size, VM_FORK_COW);
+      for (int k = 0; k < n; k++) {
+        mapped_region *stack = find_mapped_region(children[k], USER_STACK_TOP - PGSIZE);
+        stack->va = r->va;
+        stack->npages = r->npages;
+        stack->advice = r->advice;
+        stack->huge = r->huge;
+      }
       break;
     case DATA_SEGMENT:
-      child->mapped_info[i].va = parent->mapped_info[i].va;
-      for (int j = 0; j < parent->mapped_info[i].npages; j++) {
-        void *pa = alloc_page();
-        int va = parent->mapped_info[i].va + PGSIZE * j;
-        memcpy(pa, (void *)lookup_pa(parent->pagetable, va), PGSIZE);
-        user_vm_map((pagetable_t)child->pagetable, va, PGSIZE, (uint64)pa, prot_to_type(PROT_WRITE | PROT_READ, 1));
-      }
+      user_vm_fork(parent->pagetable, pts, n, r->va, size, VM_FORK_COPY);
+      for (int k = 0; k < n; k++) dup_mapped_region(children[k], r);
       break;
     case CODE_SEGMENT:
-      // TODO (lab3_1): implment the mapping of child code segment to parent's
-      // code segment.
-      // hint: the virtual address mapping of code segment is tracked in mapped_info
-      // page of parent's process structure. use the information in mapped_info to
-      // retrieve the virtual to physical mapping of code segment.
-      // after having the mapping information, just map the corresponding virtual
-      // address region of child to the physical pages that actually store the code
-      // segment of parent process.
-      // DO NOT COPY THE PHYSICAL PAGES, JUST MAP THEM.
-      // panic( "You need to implement the code segment mapping of child in lab3_1.\n" );
-
-      user_vm_map((pagetable_t)child->pagetable, parent->mapped_info[i].va & (-1 << 12), PGSIZE,
-                  lookup_pa((pagetable_t)parent->pagetable, parent->mapped_info[i].va), prot_to_type(PROT_EXEC | PROT_READ, 1));
-      sprint("do_fork map code segment at pa:%lx of parent to child at va:%lx.\n", lookup_pa((pagetable_t)parent->pagetable, parent->mapped_info[i].va), parent->mapped_info[i].va & (-1 << 12));
-      // after mapping, register the vm region (do not delete codes below!)
-      child->mapped_info[child->total_mapped_region].va = parent->mapped_info[i].va;
-      child->mapped_info[child->total_mapped_region].npages =
-          parent->mapped_info[i].npages;
-      child->mapped_info[child->total_mapped_region].seg_type = CODE_SEGMENT;
-      child->total_mapped_region++;
+      // map the children's code segment to the physical pages of parent's code segment.
+      // the pages are shared (with one more reference taken per child), not copied.
+      user_vm_fork(parent->pagetable, pts, n, r->va, size, VM_FORK_SHARE);
+      sprint("do_fork map code segment at pa:%lx of parent to child at va:%lx.\n",
+             lookup_pa(parent->pagetable, r->va), r->va);
+      // after mapping, register the vm region
+      for (int k = 0; k < n; k++) dup_mapped_region(children[k], r);
+      break;
+    case SHARED_SEGMENT:
+      // the children attach the segment as well
+      for (int k = 0; k < n; k++) shm_dup_region(parent, r, children[k]);
+      break;
+    case MMAP_SEGMENT:
+      // with the protection the pages have, the writable ones become copy-on-write
+      user_vm_fork(parent->pagetable, pts, n, r->va, size, VM_FORK_COW);
+      for (int k = 0; k < n; k++) dup_mapped_region(children[k], r);
+      break;
+    case HEAP_SEGMENT:
+      user_vm_fork(parent->pagetable, pts, n, r->va, size, VM_FORK_COW);
+      for (int k = 0; k < n; k++) {
+        dup_mapped_region(children[k], r);
+        children[k]->heap_top = vm->heap_top;
+      }
       break;
     }
   }
+}
+
+//
+// implements fork syscal in kernel.
+// basic idea here is to first allocate an empty process (child), then duplicate the
+// context and data segments of parent process to the child, and lastly, map other
+// segments (code, system) of the parent to child. the stack segment remains unchanged
+// for the child.
+//
+int do_fork(process *parent)
+{
+  sprint("will fork a child from parent %d.\n", parent->pid);
+  process *child = alloc_process();
+  if (!child) return -1;
+
+  fork_vm_space(parent, &child, 1);
+  fd_dup_all(parent, child);
 
   child->status = READY;
   child->trapframe->regs.a0 = 0;
-  child->parent = parent;
+  add_child(parent, child);
   insert_to_ready_queue(child);
 
   return child->pid;
 }
 
-int wait(int pid)
+//
+// implements fork_n syscall in kernel: forks up to "count" children in one go. each child
+// returns 0 from the syscall, with its index (0 ... count-1) stored at user address
+// index_va (if not 0) of its own vm space. returns the number of children made, or -1.
+//
+int do_fork_n(process *parent, int count, uint64 index_va)
+{
+  process *children[MAX_FORK_N];
+  int n;
+
+  if (count <= 0) return -1;
+  // the index is written to the children on behalf of the parent, so it has to be
+  // writable by the parent (the children's page tables are not checked).
+  if (index_va && ((index_va & (sizeof(int) - 1)) ||
+                   !user_va_access(parent->pagetable, index_va, 1)))
+    return -1;
+  sprint("will fork %d children from parent %d.\n", count, parent->pid);
+
+  for (n = 0; n < count && n < MAX_FORK_N; n++) {
+    if (!(children[n] = alloc_process())) break;
+    children[n]->status = READY;
+  }
+  if (n == 0) return -1;
+
+  fork_vm_space(parent, children, n);
+
+  for (int k = 0; k < n; k++) {
+    if (index_va) copy_to_user(children[k]->pagetable, index_va, &k, sizeof(int));
+    children[k]->trapframe->regs.a0 = 0;
+    fd_dup_all(parent, children[k]);
+    add_child(parent, children[k]);
+    insert_to_ready_queue(children[k]);
+  }
+
+  return n;
+}
+
+//
+// lay the strings of argv[] (argc of them, in kernel memory) and the argv pointer array
+// out at the top of the user stack of process p, and pass them to main(argc, argv) in
+// a0/a1. returns -1 if they do not fit in the stack.
+//
+int setup_user_args(process *p, int argc, char *argv[])
+{
+  uint64 sp = USER_STACK_TOP;
+  uint64 uargv[MAX_USER_ARGS + 1];
+
+  if (argc > MAX_USER_ARGS) return -1;
+
+  for (int i = argc - 1; i >= 0; i--) {
+    int len = strlen(argv[i]) + 1;
+    sp -= len;
+    // leave at least half of the stack to the program itself
+    if (sp < USER_STACK_TOP - STACK_SIZE / 2) return -1;
+    if (copy_to_user(p->pagetable, sp, argv[i], len) != 0) return -1;
+    uargv[i] = sp;
+  }
+  uargv[argc] = 0;
+
+  sp = ROUNDDOWN(sp - sizeof(uint64) * (argc + 1), 16);
+  if (copy_to_user(p->pagetable, sp, uargv, sizeof(uint64) * (argc + 1)) != 0) return -1;
+
+  p->trapframe->regs.sp = sp;
+  p->trapframe->regs.a0 = argc;
+  p->trapframe->regs.a1 = sp;
+  return 0;
+}
+
+//
+// implements exec syscall in kernel. replaces the user image of process p by the elf at
+// "path". struct process, the kernel stack and the trapframe page are reused, and the
+// user stack is emptied, while code and data segments of the old image are unmapped
+// before the new elf image is mapped. argv (argc strings in kernel memory) are passed to main() of the
+// new image. returns argc, or -1 (with p left untouched) if the elf can not be loaded.
+//
+int do_exec(process *p, const char *path, int argc, char *argv[])
 {
-  process *np;
-  process *tmp;
-  int flag = -1;
-  for (np = procs; np < &procs[NPROC]; np++) {
-    if (np != NULL && np->parent != NULL && np->parent == current && np->pid == pid) {
-      flag = 1;
-      tmp = np;
+  // other threads would lose their code and data under their feet.
+  if (p->group != p || p->nr_threads > 0) return -1;
+
+  // get the new image (and the copies of its data pages) first, so that a bad path, or
+  // running out of memory, leaves the caller intact.
+  elf_image *img = elf_image_get(path);
+  void *copies;
+  if (!img || elf_image_copy_data(img, &copies) != 0) return -1;
+
+  // tear down the old image (and detach shared segments), keeping only the regions set up
+  // by alloc_process(). free_page() only drops our references to pages shared with others.
+  mapped_region *r, *next;
+  for (r = next_mapped_region(p, 0); r; r = next) {
+    next = next_mapped_region(p, r->va + 1);
+    switch (r->seg_type) {
+    case SHARED_SEGMENT:
+      shm_release_region(p, r);
+      user_vm_unmap(p->pagetable, r->va, r->npages * PGSIZE, 1);
+      remove_mapped_region(p, r);
+      break;
+    case CODE_SEGMENT:
+    case DATA_SEGMENT:
+    case HEAP_SEGMENT:
+    case MMAP_SEGMENT:
+      user_vm_unmap(p->pagetable, r->va, (uint64)r->npages * PGSIZE, 1);
+      remove_mapped_region(p, r);
+      break;
+    case STACK_SEGMENT: {
+      // shrink the stack back to an empty top page. its pages may be shared copy-on-write
+      // (e.g., with the parent after fork), so they are not cleared in place.
+      user_vm_unmap(p->pagetable, r->va, r->npages * PGSIZE, 1);
+      void *pa = alloc_zeroed_page();
+      user_vm_map((pagetable_t)p->pagetable, USER_STACK_TOP - PGSIZE, PGSIZE, (uint64)pa,
+                  prot_to_type(PROT_WRITE | PROT_READ, 1));
+      // nothing is between, the order of the regions is kept
+      r->va = USER_STACK_TOP - PGSIZE;
+      r->npages = 1;
+      break;
+    }
     }
+  }
+  p->heap_top = 0;
+
+  // fresh user context, the user stack is emptied above.
+  memset(&p->trapframe->regs, 0, sizeof(riscv_regs));
+
+  elf_image_map_copies(img, p, copies);
+
+  // there is no old image to return to, if the arguments do not fit.
+  if (setup_user_args(p, argc, argv) != 0) {
+    sprint("exec: too many arguments for %s, process %d is terminated.\n", path, p->pid);
+    do_exit(p, -1);
+    schedule();
+  }
+
+  sprint("process %d exec %s, entry point (virtual address): 0x%lx\n", p->pid, path,
+         p->trapframe->epc);
+  return argc;
+}
+
+//
+// implements thread_create syscall in kernel: starts a thread in the vm space of p, which
+// runs from entry with arguments a0, a1 on the user stack whose top is at stack. the
+// thread has its own trapframe and kernel stack. returns the tid (a pid) of the thread,
+// or -1 on failure.
+//
+int do_thread_create(process *p, uint64 entry, uint64 a0, uint64 a1, uint64 stack)
+{
+  process *leader = p->group;
+  process *t = alloc_proc_struct();
+  if (!t) return -1;
+
+  t->group = leader;
+  t->pagetable = leader->pagetable;
+  // the trap vector saves the context while on the user page table, see alloc_process().
+  user_vm_map((pagetable_t)t->pagetable, (uint64)t->trapframe, PGSIZE,
+              (uint64)t->trapframe, prot_to_type(PROT_WRITE | PROT_READ, 0));
+
+  // inherit gp and tp, start from scratch for the rest
+  t->trapframe->regs = p->trapframe->regs;
+  t->trapframe->regs.ra = 0;
+  t->trapframe->regs.sp = ROUNDDOWN(stack, 16);
+  t->trapframe->regs.a0 = a0;
+  t->trapframe->regs.a1 = a1;
+  t->trapframe->epc = entry;
+
+  t->sibling = leader->threads;
+  leader->threads = t;
+  leader->nr_threads++;
+  insert_to_ready_queue(t);
+
+  sprint("process %d created thread %d, entry: 0x%lx.\n", p->pid, t->pid, entry);
+  return t->pid;
+}
+
+//
+// reap a ZOMBIE child, which has been unlinked from the children list of its parent, i.e.,
+// hand its process structure back to the pool.
+//
+static void reap_child(process *child)
+{
+  child->parent = NULL;
+  child->sibling = NULL;
+  child->status = FREE;
+  // or, reap_processes() will release it once its kernel stack is freed
+  if (child->kstack == 0) release_proc(child);
+}
+
+//
+// implements wait syscall in kernel: waits for the child of pid (or any child, if pid is
+// -1) to exit, and reaps it. returns the pid of reaped child, or -1 if there is no such
+// child. if the child is still running, the caller blocks and the syscall is re-issued
+// when a child of it exits.
+//
+int wait(int pid)
+{
+  if (pid != -1) {
+    process *child = find_process(pid);
+    if (!child || child->parent != current) return -1;
+  }
+
+  for (process **pp = &current->children; *pp; pp = &(*pp)->sibling) {
+    process *child = *pp;
+    if ((pid != -1 && child->pid != pid) || child->status != ZOMBIE) continue;
+    *pp = child->sibling;
+    reap_child(child);
+    return pid == -1 ? child->pid : pid;
+  }
+  if (!current->children) return -1;
+
+  // woken up by the exit of a child (see do_exit).
+  sleep_and_restart(current);
+  return -1;
+}
 
-    else if (np != NULL && np->parent != NULL && np->parent == current) {
-      flag = 0;
-      tmp = np;
+//
+// implements wait_many syscall in kernel: reaps every exited child (at most max of them),
+// and stores their pids and exit codes to the wait_status array at user address buf_va.
+// returns the number of reaped children, or -1 if the caller has no child. blocks (and
+// re-issues the syscall later) if no child has exited yet.
+//
+int wait_many(uint64 buf_va, int max)
+{
+  int n = 0;
+
+  if (max <= 0 || !current->children) return -1;
+  for (process **pp = &current->children; *pp && n < max;) {
+    process *child = *pp;
+    if (child->status != ZOMBIE) {
+      pp = &child->sibling;
+      continue;
     }
+    wait_status st = {child->pid, child->exit_code};
+    if (copy_to_user(current->pagetable, buf_va + n * sizeof(wait_status), &st, sizeof(st)) != 0)
+      return n > 0 ? n : -1;
+    *pp = child->sibling;
+    reap_child(child);
+    n++;
+  }
+  if (n == 0) sleep_and_restart(current);
+  return n;
+}
+
+//
+// implements thread_join syscall in kernel: waits for the thread of tid (in the group of
+// current) to exit, stores its exit code to user address retval_va (if not 0) and reaps
+// it. returns 0, or -1 if there is no such thread or another thread joins it already.
+//
+int thread_join(int tid, uint64 retval_va)
+{
+  process *t = find_process(tid);
+  process *leader = current->group;
+  if (!t || t == current || t == t->group || t->group != leader) return -1;
+  if (t->joiner && t->joiner != current) return -1;
+
+  if (t->status != ZOMBIE) {
+    // woken up by the exit of t (see do_exit).
+    t->joiner = current;
+    sleep_and_restart(t);
   }
-  if (flag == -1)
+
+  if (retval_va && copy_to_user(current->pagetable, retval_va, &t->exit_code, sizeof(int)) != 0)
     return -1;
-  current->status = READY;
-  insert_to_ready_queue(current);
-  schedule();
-  for (;;) {
-    if (pid == -1) {
-      for (np = procs; np < &procs[NPROC]; np++) {
-        if (np != NULL && np->parent != NULL && np->parent == current && np->status == ZOMBIE)
-          return np->pid;
-      }
-    } else if (pid > 0 && flag == 1) {
-      for (np = procs; np < &procs[NPROC]; np++) {
-        if (np != NULL && np->parent != NULL && np->parent == current && np->pid == pid && np->status == ZOMBIE)
-          return pid;
-      }
+  for (process **pp = &leader->threads; *pp; pp = &(*pp)->sibling)
+    if (*pp == t) {
+      *pp = t->sibling;
+      break;
+    }
+  reap_child(t);
+  return 0;
+}
+
+//
+// terminate process p with exit code. its ZOMBIE remains till the parent reaps it, and
+// the parent is woken up if it waits for its children. the children of p are orphaned.
+// a thread is reaped by thread_join() instead, and the group leader must not exit before
+// its threads (see sys_user_exit).
+//
+void do_exit(process *p, int code)
+{
+  process *leader = p->group;
+  p->exit_code = code;
+
+  while (p->children) {
+    process *child = p->children;
+    p->children = child->sibling;
+    // nobody will wait for an orphan
+    if (child->status == ZOMBIE) {
+      reap_child(child);
     } else {
-      return -1;
+      child->parent = NULL;
+      child->sibling = NULL;
     }
   }
+
+  if (p != leader) {
+    free_process(p);
+    if (--leader->nr_threads == 0) wakeup_process(leader, &leader->nr_threads);
+    if (p->joiner) wakeup_process(p->joiner, p);
+    return;
+  }
+
+  // the threads have all exited, reap those nobody has joined
+  while (p->threads) {
+    process *t = p->threads;
+    p->threads = t->sibling;
+    reap_child(t);
+  }
+  fd_close_all(p);
+
+  free_process(p);
+  if (p->parent)
+    wakeup_process(p->parent, p->parent);
+  else
+    p->status = FREE;
 }
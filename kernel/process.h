@@ -2,6 +2,7 @@
 #define _PROC_H_
 
 #include "riscv.h"
+#include "vma.h"
 
 typedef struct trapframe {
   // space to store context (all common registers)
@@ -18,8 +19,41 @@ typedef struct trapframe {
   /* offset:272 */ uint64 kernel_satp;
 }trapframe;
 
-// PKE kernel supports at most 32 processes
-#define NPROC 32
+// the process table grows by one page of process structures at a time, up to
+// MAX_PROC_CHUNKS pages.
+#define MAX_PROC_CHUNKS 256
+// a pid is made of the slot of process structure in the table (the low PID_SLOT_BITS bits)
+// and a generation number, bumped each time the slot is reused.
+#define PID_SLOT_BITS 16
+#define PID_GEN_BITS 14
+// most children made by one fork_n
+#define MAX_FORK_N 64
+
+// maximum number of arguments passed to main() of a user program
+#define MAX_USER_ARGS 32
+// maximum length of a path name passed to exec, including the ending NUL
+#define MAX_EXEC_PATH 256
+
+// number of fds (open files) a process may have
+#define MAX_FDS 16
+// pages mapped by default per fault on anonymous memory (see --fault_around), and at most
+// for a sequential one
+#define FAULT_AROUND_PAGES 4
+#define FAULT_AROUND_MAX 16
+
+// policies of transparent huge pages, i.e., mapping aligned 2MB blocks of heap and mmap
+// regions by megapages: in any region, only in those advised MADV_HUGEPAGE, or never
+enum thp_policies {
+  THP_ALWAYS,
+  THP_MADVISE,
+  THP_NEVER,
+};
+
+// an open file of a process. so far, only pipes can be opened.
+typedef struct file_desc_t {
+  struct pipe_t *pipe;  // NULL if the fd is not open
+  int writable;         // the write end of pipe, or the read end
+} file_desc;
 
 // possible status of a process
 enum proc_status {
@@ -28,6 +62,7 @@ enum proc_status {
   RUNNING,         // currently running
   BLOCKED,         // waiting for something
   ZOMBIE,          // terminated but not reclaimed yet
+  POOLED,          // pre-initialized, waiting in the zygote pool to be spawned
 };
 
 // types of a segment
@@ -37,15 +72,11 @@ enum segment_type {
   STACK_SEGMENT,   // runtime segment
   CONTEXT_SEGMENT, // trapframe segment
   SYSTEM_SEGMENT,  // system segment
+  SHARED_SEGMENT,  // shared memory segment
+  HEAP_SEGMENT,    // heap, grown by sbrk
+  MMAP_SEGMENT,    // anonymous memory mapped by mmap
 };
 
-// the VM regions mapped to a user process
-typedef struct mapped_region {
-  uint64 va;       // mapped virtual address
-  uint32 npages;   // mapping_info is unused if npages == 0
-  uint32 seg_type; // segment type, one of the segment_types
-} mapped_region;
-
 // the extremely simple definition of process, used for begining labs of PKE
 typedef struct process {
   // pointing to the stack used in trap handling.
@@ -55,9 +86,9 @@ typedef struct process {
   // trapframe storing the context of a (User mode) process.
   trapframe* trapframe;
 
-  // points to a page that contains mapped_regions
-  mapped_region *mapped_info;
-  // next free mapped region in mapped_info
+  // the tree of vm regions (see vma.c)
+  mapped_region *regions;
+  // number of vm regions
   int total_mapped_region;
 
   // process id
@@ -66,29 +97,99 @@ typedef struct process {
   int status;
   // parent process
   struct process *parent;
+  // children of the process, linked by sibling
+  struct process *children;
+  struct process *sibling;
+
+  // the thread group leader, i.e., the process owning the vm space (pagetable and
+  // vm regions) shared by its threads. points to the process itself if it is no thread.
+  struct process *group;
+  // (of a group leader) its threads, linked by sibling, and the number of running ones
+  struct process *threads;
+  int nr_threads;
+  // (of a thread) the thread waiting in thread_join() for it
+  struct process *joiner;
+
+  // the heap: end of the heap (program break), 0 if there is no heap yet
+  uint64 heap_top;
+
+  // fault-around (see anon_fault): pages mapped per fault, the window of the current
+  // sequential stream and the page the stream is expected to fault on next
+  int fault_around;
+  int fault_window;
+  uint64 fault_next;
+
+  // the user stack may grow down to stack_limit pages, the page below is its guard page
+  int stack_limit;
+
+  // open files, shared by the thread group (i.e., those of the leader are used)
+  file_desc fds[MAX_FDS];
   // next queue element
   struct process *queue_next;
 
+  // what the process is BLOCKED on (see sleep_and_restart)
+  void *wait_chan;
+  // exit code, kept for the parent while ZOMBIE
+  int exit_code;
+
   // accounting
   int tick_count;
 }process;
 
+// an entry of the wait_many() result array
+typedef struct wait_status_t {
+  int pid;
+  int code;
+} wait_status;
+
 // switch to run user app
 void switch_to(process*);
-// initialize process pool (the procs[] array)
+// initialize process pool (the process table)
 void init_proc_pool();
-// allocate an empty process, init its vm space. returns its pid
+// look up the live process of pid, NULL if there is none
+process* find_process(int pid);
+// allocate an empty process, init its vm space. returns NULL if none is free
 process* alloc_process();
 // reclaim a process, destruct its vm space and free physical pages.
 int free_process( process* proc );
+// free the kernel stacks and trapframes of exited processes
+void reap_processes();
+// move the program break of a process
+uint64 do_sbrk(process *p, int64 incr);
+// zero-fill the heap, stack or mmap page at va of a process, on the first touch
+int anon_fault(process *p, uint64 va, int store);
+// is a vm region of anonymous memory (heap, stack or mmap)?
+int anon_region(mapped_region *r);
+// map a zero-filled page at va in anonymous region r of a process
+int anon_map_page(process *p, mapped_region *r, uint64 va, int private);
+// map a zero-filled megapage at the 2MB block of va in anonymous region r, if allowed
+int anon_map_huge(process *p, mapped_region *r, uint64 va);
+// lowest address reserved for the user stack of p, i.e., its guard page
+uint64 stack_guard(process *p);
+// set the limit of the user stack of p (in pages), returns the old one
+int set_stack_limit(process *p, int npages);
+// start a thread sharing the vm space of p
+int do_thread_create(process *p, uint64 entry, uint64 a0, uint64 a1, uint64 stack);
+// wait for a thread of the same group to exit
+int thread_join(int tid, uint64 retval_va);
+// link child into the children of parent
+void add_child(process *parent, process *child);
 // fork a child from parent
 int do_fork(process* parent);
+// fork count children from parent in one go
+int do_fork_n(process *parent, int count, uint64 index_va);
 // wait process
 int wait(int pid);
+// reap every exited child
+int wait_many(uint64 buf_va, int max);
+// terminate a process
+void do_exit(process *p, int code);
+// replace the user image of a process by a new elf
+int do_exec(process *p, const char *path, int argc, char *argv[]);
+// pass argc/argv to main() of a user program
+int setup_user_args(process *p, int argc, char *argv[]);
 
 // current running process
 extern process* current;
-// virtual address of our simple heap
-extern uint64 g_ufree_page;
 
 #endif
@@ -175,6 +175,8 @@ static inline void flush_tlb(void) { asm volatile("sfence.vma zero, zero"); }
 #define PXMASK 0x1FF  // 9 bits
 #define PXSHIFT(level) (PGSHIFT + (9 * (level)))
 #define PX(level, va) ((((uint64)(va)) >> PXSHIFT(level)) & PXMASK)
+// bytes per megapage, i.e., a leaf PTE at level 1 maps 2MB (512 pages)
+#define HUGE_PGSIZE (1L << PXSHIFT(1))
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
 // Sv39, to avoid having to sign-extend virtual addresses
@@ -6,54 +6,76 @@
 #include "spike_interface/spike_utils.h"
 
 process* ready_queue_head = NULL;
+process* ready_queue_tail = NULL;
+// number of BLOCKED processes
+static int nr_blocked = 0;
 
 //
 // insert a process, proc, into the END of ready queue.
 //
 void insert_to_ready_queue( process* proc ) {
   sprint( "going to insert process %d to ready queue.\n", proc->pid );
-  // if the queue is empty in the beginning
-  if( ready_queue_head == NULL ){
-    proc->status = READY;
-    proc->queue_next = NULL;
-    ready_queue_head = proc;
-    return;
-  }
+  // a queued process is linked to the next one, unless it is the last one.
+  if( proc->queue_next != NULL || proc == ready_queue_tail ) return;  //already in queue
 
-  // ready queue is not empty
-  process *p;
-  // browse the ready queue to see if proc is already in-queue
-  for( p=ready_queue_head; p->queue_next!=NULL; p=p->queue_next )
-    if( p == proc ) return;  //already in queue
-
-  // p points to the last element of the ready queue
-  if( p==proc ) return;
-  p->queue_next = proc;
   proc->status = READY;
   proc->queue_next = NULL;
+  if( ready_queue_head == NULL )
+    ready_queue_head = proc;
+  else
+    ready_queue_tail->queue_next = proc;
+  ready_queue_tail = proc;
 
   return;
 }
 
+//
+// block the current process on chan (i.e., what it waits for), until wakeup_process() puts
+// it back into the ready queue. the process resumes in user mode, after the syscall being
+// handled, so its return value must be set beforehand. never returns.
+//
+void sleep_on( void* chan ) {
+  current->status = BLOCKED;
+  current->wait_chan = chan;
+  nr_blocked++;
+  schedule();
+}
+
+//
+// as sleep_on(), but the syscall being handled is re-issued when the process resumes, so
+// that it can check again whether the wait is over. never returns.
+//
+void sleep_and_restart( void* chan ) {
+  // back to the ecall instruction (see handle_syscall)
+  current->trapframe->epc -= 4;
+  sleep_on( chan );
+}
+
+//
+// wake process p up, if it is blocked on chan.
+//
+void wakeup_process( process* p, void* chan ) {
+  if( p->status != BLOCKED || p->wait_chan != chan ) return;
+  p->wait_chan = NULL;
+  nr_blocked--;
+  insert_to_ready_queue( p );
+}
+
 //
 // choose a proc from the ready queue, and put it to run.
 // note: schedule() does not take care of previous current process. If the current
 // process is still runnable, you should place it into the ready queue (by calling
 // ready_queue_insert), and then call schedule().
 //
-extern process procs[NPROC];
 void schedule() {
   if ( !ready_queue_head ){
     // by default, if there are no ready process, and all processes are in the status of
-    // FREE and ZOMBIE, we should shutdown the emulated RISC-V machine.
-    int should_shutdown = 1;
+    // FREE, ZOMBIE and POOLED (i.e., none is BLOCKED), we should shutdown the emulated
+    // RISC-V machine.
+    int should_shutdown = (nr_blocked == 0);
 
-    for( int i=0; i<NPROC; i++ )
-      if( (procs[i].status != FREE) && (procs[i].status != ZOMBIE) ){
-        should_shutdown = 0;
-        sprint( "ready queue empty, but process %d is not in free/zombie state:%d\n", 
-          i, procs[i].status );
-      }
+    if( !should_shutdown )
+      sprint( "ready queue empty, but %d process(es) are blocked.\n", nr_blocked );
 
     if( should_shutdown ){
       sprint( "no more ready processes, system shutdown now.\n" );
@@ -66,6 +88,8 @@ void schedule() {
   current = ready_queue_head;
   assert( current->status == READY );
   ready_queue_head = ready_queue_head->queue_next;
+  if( ready_queue_head == NULL ) ready_queue_tail = NULL;
+  current->queue_next = NULL;
 
   current->status == RUNNING;
   sprint( "going to schedule process %d to run.\n", current->pid );
@@ -8,5 +8,8 @@
 
 void insert_to_ready_queue( process* proc );
 void schedule();
+void sleep_on( void* chan );
+void sleep_and_restart( void* chan );
+void wakeup_process( process* p, void* chan );
 
 #endif
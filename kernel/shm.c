@@ -0,0 +1,151 @@
+/*
+ * shared memory segments. a segment is a set of physical pages, that are mapped into the vm
+ * space of every process attaching it, at an address of each process's choice. the mapping
+ * is recorded as a SHARED_SEGMENT region, which fork passes on (sharing, not copying, the
+ * pages) and exec/exit drop.
+ *
+ * the segment keeps a reference to each of its pages, and each mapping takes one more.
+ * the segment goes away when the last process detaches it (a fresh segment stays till it
+ * is attached, then detached, for the first time).
+ */
+
+#include "shm.h"
+#include "memlayout.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "riscv.h"
+#include "string.h"
+#include "util/functions.h"
+#include "spike_interface/spike_utils.h"
+
+typedef struct shm_segment_t {
+  uint64 *pages;  // physical addresses of the pages, NULL if the segment is unused
+  int npages;
+  int nattach;    // number of attachments
+} shm_segment;
+
+static shm_segment shm_segments[MAX_SHM_SEGMENTS];
+
+//
+// implements shm_create syscall in kernel: makes a segment of zeroed pages. returns the
+// id of segment, or -1 if no segment (or memory) is left.
+//
+int shm_create(uint64 size) {
+  uint64 npages = ROUNDUP(size, PGSIZE) / PGSIZE;
+  if (npages == 0 || npages > SHM_MAX_PAGES) return -1;
+
+  int id;
+  for (id = 0; id < MAX_SHM_SEGMENTS; id++)
+    if (!shm_segments[id].pages) break;
+  if (id == MAX_SHM_SEGMENTS) return -1;
+
+  shm_segment *seg = &shm_segments[id];
+  if ((seg->pages = (uint64 *)alloc_page()) == 0) return -1;
+  for (seg->npages = 0; seg->npages < npages; seg->npages++) {
+    void *pa = alloc_zeroed_page();
+    if (!pa) {
+      while (seg->npages > 0) free_page((void *)seg->pages[--seg->npages]);
+      free_page(seg->pages);
+      seg->pages = NULL;
+      return -1;
+    }
+    seg->pages[seg->npages] = (uint64)pa;
+  }
+  seg->nattach = 0;
+
+  sprint("shm: segment %d of %d page(s) created.\n", id, seg->npages);
+  return id;
+}
+
+//
+// the i-th page of segment id, as seen by the kernel.
+//
+void *shm_page(int id, int i) {
+  if (id < 0 || id >= MAX_SHM_SEGMENTS || !shm_segments[id].pages) return NULL;
+  if (i < 0 || i >= shm_segments[id].npages) return NULL;
+  return (void *)shm_segments[id].pages[i];
+}
+
+//
+// returns if [va, va + npages * PGSIZE) is free in the vm space of p: no region of p
+// overlaps it, and no page is mapped there.
+//
+static int shm_range_free(process *p, uint64 va, uint64 npages) {
+  uint64 end = va + npages * PGSIZE;
+  if (overlap_mapped_region(p, va, end)) return 0;
+  for (uint64 a = va; a < end; a += PGSIZE)
+    if (lookup_pa(p->pagetable, a)) return 0;
+  return 1;
+}
+
+//
+// map the pages of segment id at va of p, and record the region. the region keeps the id,
+// as the pages may be unmapped by the user (e.g., by free_page) meanwhile.
+//
+static void shm_map(process *p, int id, uint64 va) {
+  shm_segment *seg = &shm_segments[id];
+  for (int i = 0; i < seg->npages; i++) {
+    page_ref_inc((void *)seg->pages[i]);
+    user_vm_map((pagetable_t)p->pagetable, va + i * PGSIZE, PGSIZE, seg->pages[i],
+                prot_to_type(PROT_WRITE | PROT_READ, 1) | PTE_SHARED);
+  }
+  add_mapped_region(p, va, seg->npages, SHARED_SEGMENT, PROT_READ | PROT_WRITE)->shm_id = id;
+  seg->nattach++;
+}
+
+//
+// implements shm_attach syscall in kernel: maps segment id at user address va of p. the
+// kernel finds a free range (above USER_MMAP_BASE) if va is 0. returns the address the
+// segment is mapped at, or 0 on failure.
+//
+uint64 shm_attach(process *p, int id, uint64 va) {
+  p = p->group;
+  if (id < 0 || id >= MAX_SHM_SEGMENTS || !shm_segments[id].pages) return 0;
+  shm_segment *seg = &shm_segments[id];
+  uint64 size = seg->npages * PGSIZE;
+
+  // first fit, skipping the regions in the way
+  if (va == 0) va = find_free_range(p, USER_MMAP_BASE, stack_guard(p), size, PGSIZE);
+  // the reservation of the stack (with its guard page) is left alone
+  if ((va & (PGSIZE - 1)) || va == 0 || va + size > stack_guard(p) ||
+      !shm_range_free(p, va, seg->npages))
+    return 0;
+
+  shm_map(p, id, va);
+  sprint("shm: segment %d attached by process %d at 0x%lx.\n", id, p->pid, va);
+  return va;
+}
+
+//
+// drop an attachment of the segment mapped at region r of p. the last one frees the
+// segment, while the pages stay as long as they are mapped.
+//
+void shm_release_region(process *p, mapped_region *r) {
+  shm_segment *seg = &shm_segments[r->shm_id];
+  if (--seg->nattach > 0) return;
+
+  for (int i = 0; i < seg->npages; i++) free_page((void *)seg->pages[i]);
+  free_page(seg->pages);
+  seg->pages = NULL;
+}
+
+//
+// implements shm_detach syscall in kernel: unmaps the segment attached at user address va
+// of p. returns 0, or -1 if no segment is attached there.
+//
+int shm_detach(process *p, uint64 va) {
+  mapped_region *r = find_mapped_region(p, va);
+  if (!r || r->seg_type != SHARED_SEGMENT || r->va != va) return -1;
+
+  shm_release_region(p, r);
+  user_vm_unmap(p->pagetable, r->va, r->npages * PGSIZE, 1);
+  remove_mapped_region(p, r);
+  return 0;
+}
+
+//
+// fork: map the segment of region r (of parent) into child at the same address.
+//
+void shm_dup_region(process *parent, mapped_region *r, process *child) {
+  shm_map(child, r->shm_id, r->va);
+}
@@ -0,0 +1,24 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include "process.h"
+
+// number of shared memory segments in the system
+#define MAX_SHM_SEGMENTS 32
+// largest segment, in pages (the physical addresses of its pages fill one page)
+#define SHM_MAX_PAGES (PGSIZE / sizeof(uint64))
+
+// create a segment of size bytes, returns its id
+int shm_create(uint64 size);
+// map segment id at user address va of p (chosen by the kernel if 0), returns the address
+uint64 shm_attach(process *p, int id, uint64 va);
+// unmap the segment attached at user address va of p
+int shm_detach(process *p, uint64 va);
+// the i-th page of segment id (in the kernel's direct map), NULL if there is none
+void *shm_page(int id, int i);
+// fork: attach the segment of region r of parent to child as well
+void shm_dup_region(process *parent, mapped_region *r, process *child);
+// drop the attachment of region r of p (its pages are left to the caller to unmap)
+void shm_release_region(process *p, mapped_region *r);
+
+#endif
@@ -9,6 +9,7 @@
 #include "pmm.h"
 #include "vmm.h"
 #include "sched.h"
+#include "zygote.h"
 #include "util/functions.h"
 
 #include "spike_interface/spike_utils.h"
@@ -43,6 +44,23 @@ void handle_mtimer_trap() {
   g_ticks++;
   write_csr(sip,0);
 
+  // background work of the kernel: top the zygote pools and the pre-zeroed pages up.
+  zygote_refill();
+  zero_pool_refill();
+
+}
+
+//
+// kill current process for an access it may not make. the kernel goes on with the other
+// processes. a group leader waits for its threads first (see sys_user_exit): it is woken
+// up at the faulting instruction, and faults (and gets here) again.
+//
+static void kill_current(uint64 sepc, uint64 stval) {
+  sprint("process %d: illegal access to 0x%lx at pc 0x%lx, killed.\n", current->pid, stval,
+         sepc);
+  if (current->group == current && current->nr_threads > 0) sleep_on(&current->nr_threads);
+  do_exit(current, -1);
+  schedule();
 }
 
 //
@@ -52,15 +70,18 @@ void handle_mtimer_trap() {
 //
 void handle_user_page_fault(uint64 mcause, uint64 sepc, uint64 stval) {
   sprint("handle_page_fault: %lx\n", stval);
-  switch (mcause) {
-    case CAUSE_STORE_PAGE_FAULT:
-      map_pages((pagetable_t)current->pagetable, stval, 1, (uint64)alloc_page(),
-         prot_to_type(PROT_WRITE | PROT_READ, 1));
-      break;
-    default:
-      sprint("unknown page fault.\n");
-      break;
-  }
+  int store = mcause == CAUSE_STORE_PAGE_FAULT;
+  // the first touch of a heap or stack page
+  if (anon_fault(current, stval, store) == 0) return;
+  // a page shared copy-on-write (e.g., flipped through a pipe, or the zero page), in a
+  // region open to stores
+  mapped_region *r = find_mapped_region(current, stval);
+  if (store && r && (r->prot & PROT_WRITE) &&
+      user_cow_fault((pagetable_t)current->pagetable, stval) == 0)
+    return;
+
+  // outside the regions of the process, or a store to a read-only page
+  kill_current(sepc, stval);
 }
 
 //
@@ -93,6 +114,8 @@ void smode_trap_handler(void) {
   if ((read_csr(sstatus) & SSTATUS_SPP) != 0) panic("usertrap: not from user mode");
 
   assert(current);
+  // we are on the kernel stack of current, so those of the exited processes can go now.
+  reap_processes();
   // save user process counter.
   current->trapframe->epc = read_csr(sepc);
 
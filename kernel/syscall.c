@@ -10,9 +10,16 @@
 #include "string.h"
 #include "process.h"
 #include "util/functions.h"
+#include "memlayout.h"
 #include "pmm.h"
 #include "vmm.h"
 #include "sched.h"
+#include "zygote.h"
+#include "futex.h"
+#include "pipe.h"
+#include "shm.h"
+#include "channel.h"
+#include "mmap.h"
 
 #include "spike_interface/spike_utils.h"
 
@@ -23,7 +30,8 @@ ssize_t sys_user_print(const char* buf, size_t n) {
   //buf is an address in user space on user stack,
   //so we have to transfer it into phisical address (kernel is running in direct mapping).
   assert( current );
-  char* pa = (char*)user_va_to_pa((pagetable_t)(current->pagetable), (void*)buf);
+  char* pa = (char*)user_va_access((pagetable_t)(current->pagetable), (uint64)buf, 0);
+  if( !pa ) return -1;
   sprint(pa);
   return 0;
 }
@@ -32,32 +40,95 @@ ssize_t sys_user_print(const char* buf, size_t n) {
 // implement the SYS_user_exit syscall
 //
 ssize_t sys_user_exit(uint64 code) {
+  // the vm space of a group leader is shared by its threads, it exits after them.
+  if( current->group == current && current->nr_threads > 0 )
+    sleep_and_restart( &current->nr_threads );
+
   sprint("User exit with code:%d.\n", code);
   // in lab3 now, we should reclaim the current process, and reschedule.
-  free_process( current );
+  do_exit( current, code );
   schedule();
   return 0;
 }
 
 //
 // maybe, the simplest implementation of malloc in the world ...
+// takes a page from the top of the heap of current process, and maps it at once.
 //
 uint64 sys_user_allocate_page() {
+  process* p = current->group;
+  // start from a page boundary
+  uint64 top = p->heap_top ? p->heap_top : USER_FREE_ADDRESS_START;
+  int64 incr = ROUNDUP(top, PGSIZE) - top + PGSIZE;
+  if( do_sbrk( current, incr ) == (uint64)-1 ) return 0;
+
+  uint64 va = p->heap_top - PGSIZE;
   void* pa = alloc_page();
-  uint64 va = g_ufree_page;
-  g_ufree_page += PGSIZE;
-  user_vm_map((pagetable_t)current->pagetable, va, PGSIZE, (uint64)pa,
-         prot_to_type(PROT_WRITE | PROT_READ, 1));
+  if( !pa || map_pages((pagetable_t)current->pagetable, va, PGSIZE, (uint64)pa,
+                       prot_to_type(PROT_WRITE | PROT_READ, 1)) != 0 ) {
+    // out of memory, give the heap back
+    if( pa ) free_page( pa );
+    do_sbrk( current, -incr );
+    return 0;
+  }
 
   return va;
 }
 
+//
+// kernel entry point of rss: the number of user pages mapped by current process.
+//
+uint64 sys_user_rss() {
+  return user_vm_resident( current->pagetable );
+}
+
+//
+// kernel entry point of stack_limit
+//
+ssize_t sys_user_stack_limit(int npages) {
+  return set_stack_limit( current, npages );
+}
+
+//
+// kernel entry point of mmap
+//
+uint64 sys_user_mmap(uint64 va, uint64 len, int prot, int flags) {
+  return do_mmap( current, va, len, prot, flags );
+}
+
+//
+// kernel entry point of munmap
+//
+ssize_t sys_user_munmap(uint64 va, uint64 len) {
+  return do_munmap( current, va, len );
+}
+
+//
+// kernel entry point of mprotect
+//
+ssize_t sys_user_mprotect(uint64 va, uint64 len, int prot) {
+  return do_mprotect( current, va, len, prot );
+}
+
+//
+// kernel entry point of madvise
+//
+ssize_t sys_user_madvise(uint64 va, uint64 len, int advice) {
+  return do_madvise( current, va, len, advice );
+}
+
+//
+// kernel entry point of sbrk
+//
+uint64 sys_user_sbrk(int64 incr) {
+  return do_sbrk( current, incr );
+}
+
 //
 // reclaim a page, indicated by "va".
 //
 uint64 sys_user_free_page(uint64 va) {
-  user_vm_unmap((pagetable_t)current->pagetable, va, PGSIZE, 1);
-  return 0;
+  return user_vm_unmap((pagetable_t)current->pagetable, va, PGSIZE, 1);
 }
 
 //
@@ -72,6 +143,175 @@ ssize_t sys_user_wait(uint64 pid) {
   return wait( pid );
 }
 
+//
+// kernel entry point of fork_n
+//
+ssize_t sys_user_fork_n(int count, uint64 index_va) {
+  sprint("User call fork_n.\n");
+  return do_fork_n( current, count, index_va );
+}
+
+//
+// kernel entry point of thread_create. entry (in user library) calls fn(arg).
+//
+ssize_t sys_user_thread_create(uint64 entry, uint64 fn, uint64 arg, uint64 stack) {
+  return do_thread_create( current, entry, fn, arg, stack );
+}
+
+//
+// kernel entry point of thread_join
+//
+ssize_t sys_user_thread_join(int tid, uint64 retval_va) {
+  return thread_join( tid, retval_va );
+}
+
+//
+// kernel entry point of futex_wait
+//
+ssize_t sys_user_futex_wait(uint64 va, int expected) {
+  return futex_wait( va, expected );
+}
+
+//
+// kernel entry point of futex_wake
+//
+ssize_t sys_user_futex_wake(uint64 va, int n) {
+  return futex_wake( va, n );
+}
+
+//
+// kernel entry point of pipe
+//
+ssize_t sys_user_pipe(uint64 fds_va) {
+  return do_pipe( current, fds_va );
+}
+
+//
+// kernel entry point of read
+//
+ssize_t sys_user_read(int fd, uint64 buf_va, uint64 n) {
+  return pipe_read( current, fd, buf_va, n );
+}
+
+//
+// kernel entry point of write
+//
+ssize_t sys_user_write(int fd, uint64 buf_va, uint64 n) {
+  return pipe_write( current, fd, buf_va, n );
+}
+
+//
+// kernel entry point of close
+//
+ssize_t sys_user_close(int fd) {
+  return fd_close( current, fd );
+}
+
+//
+// kernel entry point of shm_create
+//
+ssize_t sys_user_shm_create(uint64 size) {
+  return shm_create( size );
+}
+
+//
+// kernel entry point of shm_attach
+//
+ssize_t sys_user_shm_attach(int id, uint64 va) {
+  return shm_attach( current, id, va );
+}
+
+//
+// kernel entry point of shm_detach
+//
+ssize_t sys_user_shm_detach(uint64 va) {
+  return shm_detach( current, va );
+}
+
+//
+// kernel entry point of chan_create
+//
+ssize_t sys_user_chan_create() {
+  return chan_create();
+}
+
+//
+// kernel entry point of wait_many
+//
+ssize_t sys_user_wait_many(uint64 buf_va, int max) {
+  return wait_many( buf_va, max );
+}
+
+//
+// copy a path and its NULL-terminated argv[] (NULL means argv[0] is path) from user
+// space into a kernel page "buf", laid out as: argv pointers | path | argument strings.
+// returns argc, or -1 if they are not accessible or do not fit.
+//
+static int fetch_path_and_argv(char *buf, uint64 path_va, uint64 argv_va, char **path,
+                               char ***argv) {
+  char *str = buf + sizeof(char *) * MAX_USER_ARGS + MAX_EXEC_PATH;
+  int argc = 0;
+
+  *argv = (char **)buf;
+  *path = buf + sizeof(char *) * MAX_USER_ARGS;
+  if (copy_str_from_user(current->pagetable, *path, path_va, MAX_EXEC_PATH) < 0) return -1;
+
+  if (!argv_va) {
+    (*argv)[argc++] = *path;
+    return argc;
+  }
+
+  for (;; argc++) {
+    uint64 arg_va;
+    if (copy_from_user(current->pagetable, &arg_va, argv_va + sizeof(uint64) * argc,
+                       sizeof(uint64)) != 0)
+      return -1;
+    if (!arg_va) return argc;
+    int len;
+    if (argc >= MAX_USER_ARGS ||
+        (len = copy_str_from_user(current->pagetable, str, arg_va, buf + PGSIZE - str)) < 0)
+      return -1;
+    (*argv)[argc] = str;
+    str += len + 1;
+  }
+}
+
+//
+// kernel entry point of exec. path and argv are copied into a kernel page before the
+// user image of the caller goes away.
+//
+ssize_t sys_user_exec(uint64 path_va, uint64 argv_va) {
+  char *buf = (char *)alloc_page();
+  char *path, **argv;
+  ssize_t ret = -1;
+  if (!buf) return -1;
+
+  int argc = fetch_path_and_argv(buf, path_va, argv_va, &path, &argv);
+  // on success, do_exec returns argc, which lands in a0 (the 1st argument of main) of
+  // the new image.
+  if (argc >= 0) ret = do_exec(current, path, argc, argv);
+
+  free_page(buf);
+  return ret;
+}
+
+//
+// kernel entry point of spawn. starts the elf at "path" in a new child process, which
+// is taken from the zygote pool if possible.
+//
+ssize_t sys_user_spawn(uint64 path_va, uint64 argv_va) {
+  char *buf = (char *)alloc_page();
+  char *path, **argv;
+  ssize_t ret = -1;
+  if (!buf) return -1;
+
+  int argc = fetch_path_and_argv(buf, path_va, argv_va, &path, &argv);
+  if (argc >= 0) ret = do_spawn(current, path, argc, argv);
+
+  free_page(buf);
+  return ret;
+}
+
 //
 // kerenl entry point of yield
 //
@@ -108,6 +348,52 @@ long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, long a6, l
       return sys_user_yield();
     case SYS_user_wait:
       return sys_user_wait(a1);
+    case SYS_user_exec:
+      return sys_user_exec(a1, a2);
+    case SYS_user_spawn:
+      return sys_user_spawn(a1, a2);
+    case SYS_user_fork_n:
+      return sys_user_fork_n(a1, a2);
+    case SYS_user_wait_many:
+      return sys_user_wait_many(a1, a2);
+    case SYS_user_thread_create:
+      return sys_user_thread_create(a1, a2, a3, a4);
+    case SYS_user_thread_join:
+      return sys_user_thread_join(a1, a2);
+    case SYS_user_futex_wait:
+      return sys_user_futex_wait(a1, a2);
+    case SYS_user_futex_wake:
+      return sys_user_futex_wake(a1, a2);
+    case SYS_user_pipe:
+      return sys_user_pipe(a1);
+    case SYS_user_read:
+      return sys_user_read(a1, a2, a3);
+    case SYS_user_write:
+      return sys_user_write(a1, a2, a3);
+    case SYS_user_close:
+      return sys_user_close(a1);
+    case SYS_user_shm_create:
+      return sys_user_shm_create(a1);
+    case SYS_user_shm_attach:
+      return sys_user_shm_attach(a1, a2);
+    case SYS_user_shm_detach:
+      return sys_user_shm_detach(a1);
+    case SYS_user_chan_create:
+      return sys_user_chan_create();
+    case SYS_user_sbrk:
+      return sys_user_sbrk(a1);
+    case SYS_user_rss:
+      return sys_user_rss();
+    case SYS_user_stack_limit:
+      return sys_user_stack_limit(a1);
+    case SYS_user_mmap:
+      return sys_user_mmap(a1, a2, a3, a4);
+    case SYS_user_munmap:
+      return sys_user_munmap(a1, a2);
+    case SYS_user_mprotect:
+      return sys_user_mprotect(a1, a2, a3);
+    case SYS_user_madvise:
+      return sys_user_madvise(a1, a2, a3);
     default:
       panic("Unknown syscall %ld \n", a0);
   }
@@ -13,6 +13,29 @@
 #define SYS_user_fork (SYS_user_base + 4)
 #define SYS_user_yield (SYS_user_base + 5)
 #define SYS_user_wait (SYS_user_base + 6)
+#define SYS_user_exec (SYS_user_base + 7)
+#define SYS_user_spawn (SYS_user_base + 8)
+#define SYS_user_fork_n (SYS_user_base + 9)
+#define SYS_user_wait_many (SYS_user_base + 10)
+#define SYS_user_thread_create (SYS_user_base + 11)
+#define SYS_user_thread_join (SYS_user_base + 12)
+#define SYS_user_futex_wait (SYS_user_base + 13)
+#define SYS_user_futex_wake (SYS_user_base + 14)
+#define SYS_user_pipe (SYS_user_base + 15)
+#define SYS_user_read (SYS_user_base + 16)
+#define SYS_user_write (SYS_user_base + 17)
+#define SYS_user_close (SYS_user_base + 18)
+#define SYS_user_shm_create (SYS_user_base + 19)
+#define SYS_user_shm_attach (SYS_user_base + 20)
+#define SYS_user_shm_detach (SYS_user_base + 21)
+#define SYS_user_chan_create (SYS_user_base + 22)
+#define SYS_user_sbrk (SYS_user_base + 23)
+#define SYS_user_rss (SYS_user_base + 24)
+#define SYS_user_stack_limit (SYS_user_base + 25)
+#define SYS_user_mmap (SYS_user_base + 26)
+#define SYS_user_munmap (SYS_user_base + 27)
+#define SYS_user_mprotect (SYS_user_base + 28)
+#define SYS_user_madvise (SYS_user_base + 29)
 
 long do_syscall(long a0, long a1, long a2, long a3, long a4, long a5, long a6, long a7);
 
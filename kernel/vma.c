@@ -0,0 +1,316 @@
+/*
+ * the vm regions of a process, kept in an AVL tree sorted by address. the tree is owned
+ * by the thread group leader, so all the functions below act on p->group.
+ *
+ * the nodes are carved from pages taken on demand, and recycled through a free list (they
+ * are never given back), so there is no limit on the number of regions of a process.
+ */
+
+#include "vma.h"
+#include "process.h"
+#include "pmm.h"
+#include "riscv.h"
+#include "util/functions.h"
+#include "spike_interface/spike_utils.h"
+
+// free nodes, linked by "right"
+static mapped_region *free_regions;
+
+static mapped_region *alloc_region(void) {
+  if (!free_regions) {
+    mapped_region *page = (mapped_region *)alloc_page();
+    if (!page) panic("no memory for vm regions.\n");
+    for (int i = 0; i < PGSIZE / sizeof(mapped_region); i++) {
+      page[i].right = free_regions;
+      free_regions = &page[i];
+    }
+  }
+  mapped_region *r = free_regions;
+  free_regions = r->right;
+  return r;
+}
+
+static void free_region(mapped_region *r) {
+  r->npages = 0;
+  r->right = free_regions;
+  free_regions = r;
+}
+
+static uint64 region_end(mapped_region *r) { return r->va + (uint64)r->npages * PGSIZE; }
+
+// has the region been given any advice (see madvise)?
+static int region_advised(mapped_region *r) { return r->advice != MADV_NORMAL || r->huge; }
+
+//
+// regions of these types may be merged when they are adjacent (and of the same protection):
+// they are mapped alike page by page, and nothing else refers to the region as a whole.
+//
+static int region_mergeable(uint32 seg_type) {
+  return seg_type == CODE_SEGMENT || seg_type == DATA_SEGMENT || seg_type == MMAP_SEGMENT;
+}
+
+/* --- AVL tree --- */
+
+static int height(mapped_region *r) { return r ? r->height : 0; }
+
+static void fix_height(mapped_region *r) {
+  r->height = MAX(height(r->left), height(r->right)) + 1;
+}
+
+static mapped_region *rotate_right(mapped_region *r) {
+  mapped_region *l = r->left;
+  r->left = l->right;
+  l->right = r;
+  fix_height(r);
+  fix_height(l);
+  return l;
+}
+
+static mapped_region *rotate_left(mapped_region *r) {
+  mapped_region *l = r->right;
+  r->right = l->left;
+  l->left = r;
+  fix_height(r);
+  fix_height(l);
+  return l;
+}
+
+//
+// restore the balance of subtree r, whose children are balanced. returns the new root.
+//
+static mapped_region *balance(mapped_region *r) {
+  fix_height(r);
+  int diff = height(r->left) - height(r->right);
+  if (diff > 1) {
+    if (height(r->left->left) < height(r->left->right)) r->left = rotate_left(r->left);
+    return rotate_right(r);
+  }
+  if (diff < -1) {
+    if (height(r->right->right) < height(r->right->left)) r->right = rotate_right(r->right);
+    return rotate_left(r);
+  }
+  return r;
+}
+
+static mapped_region *tree_insert(mapped_region *t, mapped_region *r) {
+  if (!t) return r;
+  if (r->va == t->va) panic("vm region 0x%lx recorded twice.\n", r->va);
+  if (r->va < t->va)
+    t->left = tree_insert(t->left, r);
+  else
+    t->right = tree_insert(t->right, r);
+  return balance(t);
+}
+
+//
+// detach the leftmost node of subtree t into *min. returns the new root.
+//
+static mapped_region *tree_remove_min(mapped_region *t, mapped_region **min) {
+  if (!t->left) {
+    *min = t;
+    return t->right;
+  }
+  t->left = tree_remove_min(t->left, min);
+  return balance(t);
+}
+
+static mapped_region *tree_remove(mapped_region *t, uint64 va) {
+  if (!t) return NULL;
+  if (va < t->va) {
+    t->left = tree_remove(t->left, va);
+  } else if (va > t->va) {
+    t->right = tree_remove(t->right, va);
+  } else {
+    if (!t->left || !t->right) return t->left ? t->left : t->right;
+    mapped_region *m;
+    mapped_region *right = tree_remove_min(t->right, &m);
+    m->left = t->left;
+    m->right = right;
+    t = m;
+  }
+  return balance(t);
+}
+
+//
+// the region of the highest va at or below va, NULL if there is none.
+//
+static mapped_region *tree_floor(mapped_region *t, uint64 va) {
+  mapped_region *found = NULL;
+  while (t) {
+    if (t->va <= va) {
+      found = t;
+      t = t->right;
+    } else {
+      t = t->left;
+    }
+  }
+  return found;
+}
+
+/* --- regions of a process --- */
+
+static mapped_region *insert_region(process *p, uint64 va, uint32 npages, uint32 seg_type,
+                                    int prot) {
+  mapped_region *r = alloc_region();
+  r->va = va;
+  r->npages = npages;
+  r->seg_type = seg_type;
+  r->prot = prot;
+  r->advice = MADV_NORMAL;
+  r->huge = 0;
+  r->left = r->right = NULL;
+  r->height = 1;
+  p->regions = tree_insert(p->regions, r);
+  p->total_mapped_region++;
+  return r;
+}
+
+//
+// record a vm region [va, va + npages * PGSIZE) of type seg_type, whose pages are mapped
+// with protection prot, in process p (shared by its thread group). a region adjacent to
+// one (or two) of the same type and protection is merged into it, if regions of that type
+// may be merged. returns the region holding the range.
+//
+mapped_region *add_mapped_region(process *p, uint64 va, uint32 npages, uint32 seg_type,
+                                 int prot)
+{
+  p = p->group;
+  mapped_region *prev = va ? tree_floor(p->regions, va - 1) : NULL;
+  mapped_region *next = next_mapped_region(p, va);
+
+  if (region_mergeable(seg_type)) {
+    // a new region has no advice, those advised otherwise are kept apart
+    int with_prev = prev && prev->seg_type == seg_type && prev->prot == prot &&
+                    !region_advised(prev) && region_end(prev) == va;
+    int with_next = next && next->seg_type == seg_type && next->prot == prot &&
+                    !region_advised(next) && next->va == va + (uint64)npages * PGSIZE;
+    if (with_prev) {
+      prev->npages += npages;
+      if (with_next) {
+        prev->npages += next->npages;
+        remove_mapped_region(p, next);
+      }
+      return prev;
+    }
+    if (with_next) {
+      // the order of the regions is kept, as next is the first one above va
+      next->va = va;
+      next->npages += npages;
+      return next;
+    }
+  }
+
+  return insert_region(p, va, npages, seg_type, prot);
+}
+
+//
+// record a copy of region r (of another process, e.g., the parent on fork) in process p
+// (shared by its thread group), as it is: of the same type, protection and advice.
+// returns the copy.
+//
+mapped_region *dup_mapped_region(process *p, mapped_region *r)
+{
+  mapped_region *copy = insert_region(p->group, r->va, r->npages, r->seg_type, r->prot);
+  copy->advice = r->advice;
+  copy->huge = r->huge;
+  return copy;
+}
+
+//
+// split region r of process p (shared by its thread group) at va, a page boundary inside
+// r: r keeps [r->va, va), and a new region of the same type, protection and advice (which
+// is not merged back) takes the rest. returns the new region.
+//
+mapped_region *split_mapped_region(process *p, mapped_region *r, uint64 va)
+{
+  uint32 npages = (va - r->va) / PGSIZE;
+  mapped_region *rest = insert_region(p->group, va, r->npages - npages, r->seg_type, r->prot);
+  rest->advice = r->advice;
+  rest->huge = r->huge;
+  r->npages = npages;
+  return rest;
+}
+
+//
+// drop region r from process p (shared by its thread group).
+//
+void remove_mapped_region(process *p, mapped_region *r)
+{
+  p = p->group;
+  p->regions = tree_remove(p->regions, r->va);
+  p->total_mapped_region--;
+  free_region(r);
+}
+
+//
+// find the region of process p (shared by its thread group) that holds va. returns NULL
+// if va is in no region.
+//
+mapped_region *find_mapped_region(process *p, uint64 va)
+{
+  mapped_region *r = tree_floor(p->group->regions, va);
+  return r && va < region_end(r) ? r : NULL;
+}
+
+//
+// the first region of process p (shared by its thread group) starting at or above va, or
+// NULL if there is none. the regions are browsed in the order of addresses by:
+//   for (r = next_mapped_region(p, 0); r; r = next_mapped_region(p, r->va + 1))
+//
+mapped_region *next_mapped_region(process *p, uint64 va)
+{
+  mapped_region *t = p->group->regions, *found = NULL;
+  while (t) {
+    if (t->va >= va) {
+      found = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  return found;
+}
+
+//
+// the lowest region of process p (shared by its thread group) overlapping [va, end), or
+// NULL if the range is free.
+//
+mapped_region *overlap_mapped_region(process *p, uint64 va, uint64 end)
+{
+  mapped_region *r = find_mapped_region(p, va);
+  if (r) return r;
+  r = next_mapped_region(p, va);
+  return r && r->va < end ? r : NULL;
+}
+
+//
+// the lowest free range of size bytes (a multiple of PGSIZE) in [lo, hi) of process p,
+// i.e., overlapping none of its regions, that starts at a multiple of align. returns its
+// address, or 0 if there is none.
+//
+uint64 find_free_range(process *p, uint64 lo, uint64 hi, uint64 size, uint64 align)
+{
+  uint64 va = ROUNDUP(lo, align);
+  mapped_region *r;
+  // skip the regions in the way
+  while (va + size <= hi && (r = overlap_mapped_region(p, va, va + size)) != NULL)
+    va = ROUNDUP(region_end(r), align);
+  return va + size <= hi ? va : 0;
+}
+
+static void free_tree(mapped_region *t) {
+  if (!t) return;
+  free_tree(t->left);
+  free_tree(t->right);
+  free_region(t);
+}
+
+//
+// drop all the regions of process p (a group leader).
+//
+void free_mapped_regions(process *p)
+{
+  free_tree(p->regions);
+  p->regions = NULL;
+  p->total_mapped_region = 0;
+}
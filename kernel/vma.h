@@ -0,0 +1,56 @@
+#ifndef _VMA_H_
+#define _VMA_H_
+
+#include "util/types.h"
+
+struct process;
+
+// advice of madvise: access pattern hints of anonymous memory, kept in its regions
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+// and the requests to act on its pages at once
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+// and whether it should be mapped by megapages (see thp_policy), kept in its regions too
+#define MADV_HUGEPAGE 5
+#define MADV_NOHUGEPAGE 6
+
+// a VM region mapped to a user process. the regions of a process are the nodes of an AVL
+// tree sorted by va (they never overlap), so that the region holding an address is found
+// in O(log n).
+typedef struct mapped_region {
+  uint64 va;       // mapped virtual address
+  uint32 npages;   // number of pages, may be 0 (e.g., an empty heap)
+  uint32 seg_type; // segment type, one of the segment_types
+  int prot;        // protection of the pages (PROT_* of vmm.h)
+  int advice;      // access pattern of the pages (MADV_NORMAL/RANDOM/SEQUENTIAL)
+  int huge;        // MADV_HUGEPAGE/NOHUGEPAGE, or 0 if not advised
+  int shm_id;      // the shared memory segment mapped, for a SHARED_SEGMENT region
+  // links of the tree
+  struct mapped_region *left, *right;
+  int height;
+} mapped_region;
+
+// record a vm region in a process, merged with an adjacent one if they are compatible
+mapped_region *add_mapped_region(struct process *p, uint64 va, uint32 npages, uint32 seg_type,
+                                 int prot);
+// record a copy of vm region r (of another process) in a process, e.g., on fork
+mapped_region *dup_mapped_region(struct process *p, mapped_region *r);
+// split a vm region of a process in two at va
+mapped_region *split_mapped_region(struct process *p, mapped_region *r, uint64 va);
+// drop a vm region from a process
+void remove_mapped_region(struct process *p, mapped_region *r);
+// find the vm region (of a process) holding va, NULL if there is none
+mapped_region *find_mapped_region(struct process *p, uint64 va);
+// the first vm region (of a process) at or above va, i.e., in the order of addresses
+mapped_region *next_mapped_region(struct process *p, uint64 va);
+// a vm region (of a process) overlapping [va, end), NULL if there is none
+mapped_region *overlap_mapped_region(struct process *p, uint64 va, uint64 end);
+// the lowest free range of size bytes in [lo, hi) of a process, starting at a multiple of
+// align (a power of 2, PGSIZE at least). 0 if there is none
+uint64 find_free_range(struct process *p, uint64 lo, uint64 hi, uint64 size, uint64 align);
+// drop all the vm regions of a process
+void free_mapped_regions(struct process *p);
+
+#endif
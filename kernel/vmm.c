@@ -12,6 +12,59 @@
 #include "util/functions.h"
 
 /* --- utility functions for virtual address mapping --- */
+
+// freed page-table pages, kept for quick reuse by page_walk(). they are all-zero (but the
+// link to the next one in the first word) as their PTEs are cleared before they are freed.
+// the ones beyond the quicklist go to the pool of pre-zeroed pages (see pmm.c).
+#define PT_QUICKLIST_MAX 64
+static pte_t *pt_quicklist;
+static int pt_quicklist_len;
+
+//
+// get a zeroed page to be a page table, from the quicklist if possible, or else from the
+// pre-zeroed pages.
+//
+static pagetable_t alloc_pt_page(void) {
+  pte_t *pt = pt_quicklist;
+  if (pt) {
+    pt_quicklist = (pte_t *)pt[0];
+    pt_quicklist_len--;
+    pt[0] = 0;
+    return pt;
+  }
+  return (pagetable_t)alloc_zeroed_page();
+}
+
+//
+// give a page table (whose PTEs are all cleared) back, to the quicklist unless it is full.
+//
+static void free_pt_page(pagetable_t pt) {
+  if (pt_quicklist_len >= PT_QUICKLIST_MAX) {
+    free_zeroed_page(pt);
+    return;
+  }
+  pt[0] = (pte_t)pt_quicklist;
+  pt_quicklist = pt;
+  pt_quicklist_len++;
+}
+
+// is pte a leaf, i.e., does it map memory rather than point to a page table?
+static int pte_leaf(pte_t pte) { return (pte & (PTE_R | PTE_W | PTE_X)) != 0; }
+
+//
+// split the megapage mapped by pte (a leaf at level 1) into the 512 pages it is made of,
+// mapped alike by a new page table. the pages keep their references, as the reference
+// counts are kept per page anyway. returns -1 if there is no memory for the page table.
+//
+static int huge_split(pte_t *pte) {
+  pagetable_t pt = alloc_pt_page();
+  if (!pt) return -1;
+  uint64 pa = PTE2PA(*pte), flags = PTE_FLAGS(*pte);
+  for (int i = 0; i < PGSIZE / sizeof(pte_t); i++) pt[i] = PA2PTE(pa + (uint64)i * PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
 //
 // establish mapping of virtual address [va, va+size] to phyiscal address [pa, pa+size]
 // with the permission of "perm".
@@ -46,6 +99,8 @@ uint64 prot_to_type(int prot, int user) {
 //
 // traverse the page table (starting from page_dir) to find the corresponding pte of va.
 // returns: PTE (page table entry) pointing to va.
+// a megapage on the way is split (see huge_split), as the PTE of a single page is asked
+// for. use leaf_walk() to look a mapping up as it is.
 //
 pte_t *page_walk(pagetable_t page_dir, uint64 va, int alloc) {
   if (va >= MAXVA) panic("page_walk");
@@ -64,12 +119,12 @@ pte_t *page_walk(pagetable_t page_dir, uint64 va, int alloc) {
     // now, we need to know if above pte is valid (established mapping to phyiscal page)
     // or not.
     if (*pte & PTE_V) {  //PTE valid
+      if (pte_leaf(*pte) && huge_split(pte) != 0) return 0;
       // phisical address of pagetable of next level
       pt = (pagetable_t)PTE2PA(*pte);
     } else { //PTE invalid (not exist).
       // allocate a page (to be the new pagetable), if alloc == 1
-      if( alloc && ((pt = (pte_t *)alloc_page(1)) != 0) ){
-        memset(pt, 0, PGSIZE);
+      if( alloc && ((pt = alloc_pt_page()) != 0) ){
         // writes the physical address of newly allocated page to pte, to establish the
         // page table tree.
         *pte = PA2PTE(pt) | PTE_V;
@@ -82,19 +137,97 @@ pte_t *page_walk(pagetable_t page_dir, uint64 va, int alloc) {
   return pt + PX(0, va);
 }
 
+//
+// find the leaf PTE mapping va, of a page (level 0) or of a megapage (level 1), without
+// splitting anything. the level is stored to *level, unless it is NULL. returns NULL if
+// va is not mapped.
+//
+pte_t *leaf_walk(pagetable_t page_dir, uint64 va, int *level) {
+  if (va >= MAXVA) return 0;
+
+  pagetable_t pt = page_dir;
+  for (int l = 2; l >= 0; l--) {
+    pte_t *pte = pt + PX(l, va);
+    if ((*pte & PTE_V) == 0) return 0;
+    if (l == 0 || pte_leaf(*pte)) {
+      if (level) *level = l;
+      return pte;
+    }
+    pt = (pagetable_t)PTE2PA(*pte);
+  }
+  return 0;
+}
+
+//
+// the level 1 PTE of va, i.e., the one mapping the megapage of va (if any). the page
+// table it lives in is allocated if "alloc" is set. returns NULL if there is no such
+// page table.
+//
+pte_t *huge_walk(pagetable_t page_dir, uint64 va, int alloc) {
+  if (va >= MAXVA) panic("huge_walk");
+
+  pte_t *pte = page_dir + PX(2, va);
+  if ((*pte & PTE_V) == 0) {
+    pagetable_t pt;
+    if (!alloc || (pt = alloc_pt_page()) == 0) return 0;
+    *pte = PA2PTE(pt) | PTE_V;
+  }
+  return (pagetable_t)PTE2PA(*pte) + PX(1, va);
+}
+
+//
+// walk the part of [va, end) covered by page table pt of the given level, for walk_range.
+//
+static int walk_level(pagetable_t pt, int level, uint64 va, uint64 end, pte_visitor fn,
+                      void *arg) {
+  uint64 size = 1L << PXSHIFT(level);
+
+  for (uint64 a = va; a < end; a = ROUNDDOWN(a, size) + size) {
+    pte_t *pte = pt + PX(level, a);
+    if ((*pte & PTE_V) == 0) continue;
+    uint64 base = ROUNDDOWN(a, size), next = MIN(base + size, end);
+    // a megapage partly in the range
+    if (level > 0 && pte_leaf(*pte) && (a != base || next != base + size) &&
+        huge_split(pte) != 0)
+      return -1;
+
+    int ret = 0;
+    if (pte_leaf(*pte))
+      ret = fn(pte, base, level, arg);
+    else if (level > 0)
+      ret = walk_level((pagetable_t)PTE2PA(*pte), level - 1, a, next, fn, arg);
+    if (ret) return ret;
+  }
+  return 0;
+}
+
+//
+// call fn(pte, va, level, arg) on each leaf PTE mapping a part of [va, end) in page_dir,
+// in the order of addresses, where va is the address the leaf maps (of a page, or of a
+// megapage at level 1). invalid PTEs are passed by, and so are the subtrees below them,
+// so that a walk costs in the number of pages mapped rather than in the size of the
+// range. fn may change or clear the PTE. a megapage partly in the range is split first.
+// the walk stops as soon as fn returns nonzero. returns that value, 0 if fn never does,
+// or -1 if there is no memory to split a megapage.
+//
+int walk_range(pagetable_t page_dir, uint64 va, uint64 end, pte_visitor fn, void *arg) {
+  if (end > MAXVA) panic("walk_range");
+  return walk_level(page_dir, 2, ROUNDDOWN(va, PGSIZE), end, fn, arg);
+}
+
 //
 // look up a virtual page address, return the physical page address or 0 if not mapped.
 //
 uint64 lookup_pa(pagetable_t pagetable, uint64 va) {
   pte_t *pte;
   uint64 pa;
+  int level;
 
-  if (va >= MAXVA) return 0;
-
-  pte = page_walk(pagetable, va, 0);
-  if (pte == 0 || (*pte & PTE_V) == 0 || ((*pte & PTE_R) == 0 && (*pte & PTE_W) == 0))
+  pte = leaf_walk(pagetable, va, &level);
+  if (pte == 0 || ((*pte & PTE_R) == 0 && (*pte & PTE_W) == 0))
     return 0;
-  pa = PTE2PA(*pte);
+  // the page of va inside a megapage
+  pa = PTE2PA(*pte) + (va & ((1L << PXSHIFT(level)) - 1) & ~(uint64)(PGSIZE - 1));
 
   return pa;
 }
@@ -158,10 +291,138 @@ void *user_va_to_pa(pagetable_t page_dir, void *va) {
   // Also, it is possible that "va" is not mapped at all. in such case, we can find
   // invalid PTE, and should return NULL.
   //panic( "You have to implement user_va_to_pa (convert user va to pa) to print messages in lab2_1.\n" );
-  pte_t* pte = page_walk(page_dir,(uint64)va, 0);
+  int level;
+  pte_t* pte = leaf_walk(page_dir, (uint64)va, &level);
   if (pte == 0)
     return 0;
-  return (void*)(PTE2PA(*pte) + ((uint64)va & ((1<<PGSHIFT)-1)));
+  return (void*)(PTE2PA(*pte) + ((uint64)va & ((1L << PXSHIFT(level)) - 1)));
+}
+
+// the shared zero page. untouched anonymous memory is mapped to it (copy-on-write) on
+// loads, so that pages which are only read cost no memory. it is pinned (see pin_page),
+// as it may be mapped more times than a reference count can hold, so it is never freed,
+// and never written in place.
+static void *zero_page;
+
+//
+// the zero page, for a user mapping. returns its physical address.
+//
+uint64 user_zero_page(void) {
+  if (!zero_page) {
+    if ((zero_page = alloc_page()) == 0) panic("no memory for the zero page.\n");
+    memset(zero_page, 0, PGSIZE);
+    pin_page(zero_page);
+  }
+  return (uint64)zero_page;
+}
+
+//
+// is the physical page at pa the zero page?
+//
+int user_page_is_zero(uint64 pa) { return zero_page && pa == (uint64)zero_page; }
+
+//
+// give the user page of pte a private copy (unless it is the only user of the page), and
+// make it writable again.
+//
+static int cow_break(pte_t *pte) {
+  void *old = (void *)PTE2PA(*pte);
+  void *pa = old;
+
+  if (page_ref_count(old) > 1) {
+    // nothing to read from the zero page
+    if (old == zero_page)
+      pa = alloc_zeroed_page();
+    else if ((pa = alloc_page()) != 0)
+      memcpy(pa, old, PGSIZE);
+    if (pa == 0) return -1;
+    free_page(old);
+  }
+  *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W | PTE_D;
+  return 0;
+}
+
+//
+// may the user write to va, as far as the protection of the region holding it goes? a
+// copy-on-write page is not writable as such. the regions are checked for the current
+// process only: the kernel is trusted with other page tables (e.g., of a child it sets up).
+//
+static int user_region_writable(pagetable_t page_dir, uint64 va) {
+  if (!current || current->pagetable != page_dir) return 1;
+  mapped_region *r = find_mapped_region(current, va);
+  return r && (r->prot & PROT_WRITE);
+}
+
+//
+// the physical address of user address va, for the kernel to access it (for a write if
+// "write" is set) through the direct map, as the user would. so anonymous memory (of the
+// current process) that has not been touched yet is faulted in, and a write breaks
+// copy-on-write sharing first, if the region is writable at all. pages out of reach of
+// the user (e.g., PROT_NONE) are out of reach here as well. returns NULL if va is not
+// accessible.
+//
+void *user_va_access(pagetable_t page_dir, uint64 va, int write) {
+  pte_t *pte = leaf_walk(page_dir, va, 0);
+  if (!pte && current && current->pagetable == page_dir && anon_fault(current, va, write) == 0)
+    pte = leaf_walk(page_dir, va, 0);
+  if (!pte || !(*pte & PTE_U)) return 0;
+  if (write && !(*pte & PTE_W)) {
+    if (!(*pte & PTE_COW) || !user_region_writable(page_dir, va) ||
+        user_cow_fault(page_dir, va) != 0)
+      return 0;
+  }
+  return user_va_to_pa(page_dir, (void *)va);
+}
+
+//
+// copy n bytes from kernel buffer src to user virtual address va, page by page.
+// returns 0 on success, or -1 if part of [va, va+n) is not accessible.
+//
+int copy_to_user(pagetable_t page_dir, uint64 va, const void *src, uint64 n) {
+  while (n > 0) {
+    char *pa = user_va_access(page_dir, va, 1);
+    if (pa == 0) return -1;
+    uint64 len = MIN(n, PGSIZE - (va & (PGSIZE - 1)));
+    memcpy(pa, src, len);
+    src = (const char *)src + len;
+    va += len;
+    n -= len;
+  }
+  return 0;
+}
+
+//
+// copy n bytes from user virtual address va to kernel buffer dst, page by page.
+// returns 0 on success, or -1 if part of [va, va+n) is not accessible.
+//
+int copy_from_user(pagetable_t page_dir, void *dst, uint64 va, uint64 n) {
+  while (n > 0) {
+    char *pa = user_va_access(page_dir, va, 0);
+    if (pa == 0) return -1;
+    uint64 len = MIN(n, PGSIZE - (va & (PGSIZE - 1)));
+    memcpy(dst, pa, len);
+    dst = (char *)dst + len;
+    va += len;
+    n -= len;
+  }
+  return 0;
+}
+
+//
+// copy a NUL-terminated string of at most "max" bytes (NUL included) from user virtual
+// address va to kernel buffer dst. returns the length of the string, or -1 if the string
+// is not mapped or is longer than allowed.
+//
+int copy_str_from_user(pagetable_t page_dir, char *dst, uint64 va, int max) {
+  int i = 0;
+  while (i < max) {
+    char *pa = user_va_access(page_dir, va, 0);
+    if (pa == 0) return -1;
+    // copy till the end of current page
+    for (uint64 left = PGSIZE - (va & (PGSIZE - 1)); left > 0 && i < max; left--, i++, va++)
+      if ((dst[i] = *pa++) == 0) return i;
+  }
+  return -1;
 }
 
 //
@@ -173,11 +434,46 @@ void user_vm_map(pagetable_t page_dir, uint64 va, uint64 size, uint64 pa, int pe
   }
 }
 
+//
+// drop the references to the pages mapped by leaf pte of the given level, one page or
+// all those of a megapage.
+//
+static void free_leaf(pte_t pte, int level) {
+  for (uint64 off = 0; off < (1L << PXSHIFT(level)); off += PGSIZE)
+    free_page((void *)(PTE2PA(pte) + off));
+}
+
+static int unmap_leaf(pte_t *pte, uint64 va, int level, void *free) {
+  if (*(int *)free) free_leaf(*pte, level);
+  *pte = 0;
+  return 0;
+}
+
+//
+// split the megapages that [va, end) covers in part, i.e., those at its ends, into pages
+// mapped alike. a walk over the range (see walk_range) needs no memory afterwards, so that
+// a caller may split first and then change the range without having to back out. returns
+// 0, or -1 if there is no memory for a page table.
+//
+int user_vm_split(pagetable_t page_dir, uint64 va, uint64 end) {
+  uint64 ends[2] = {va, end};
+  for (int i = 0; i < 2; i++) {
+    int level;
+    pte_t *pte;
+    if ((ends[i] & (HUGE_PGSIZE - 1)) == 0) continue;
+    if ((pte = leaf_walk(page_dir, ends[i], &level)) && level == 1 && huge_split(pte) != 0)
+      return -1;
+  }
+  return 0;
+}
+
 //
 // unmap virtual address [va, va+size] from the user app.
 // reclaim the physical pages if free!=0
+// returns 0, or -1 (and nothing is unmapped) if a megapage partly in the range can not be
+// split for lack of memory.
 //
-void user_vm_unmap(pagetable_t page_dir, uint64 va, uint64 size, int free) {
+int user_vm_unmap(pagetable_t page_dir, uint64 va, uint64 size, int free) {
   // TODO (lab2_2): implement user_vm_unmap to disable the mapping of the virtual pages
   // in [va, va+size], and free the corresponding physical pages used by the virtual
   // addresses when if free is not zero.
@@ -186,10 +482,169 @@ void user_vm_unmap(pagetable_t page_dir, uint64 va, uint64 size, int free) {
   // as naive_free reclaims only one page at a time, you only need to consider one page
   // to make user/app_naive_malloc to produce the correct hehavior.
   //panic( "You have to implement user_vm_unmap to free pages using naive_free in lab2_2.\n" );
-  pte_t* pte = page_walk(page_dir,va, 0);
-  void *pa=(void*)(PTE2PA(*pte) + (va & ((1<<PGSHIFT)-1)));
-  free_page(pa);
-  *pte^=PTE_V;
+  // a megapage in the range as a whole goes at once
+  if (user_vm_split(page_dir, va, va + size) != 0) return -1;
+  walk_range(page_dir, va, va + size, unmap_leaf, &free);
+  return 0;
+}
+
+//
+// clear the PTEs in page table pt (of the given level), free the user pages (PTE_U) they
+// map and the page tables below. pages mapped without PTE_U (i.e., the trapframe and the
+// trap vector section) are left to the kernel.
+//
+static void free_pt_level(pagetable_t pt, int level) {
+  for (int i = 0; i < PGSIZE / sizeof(pte_t); i++) {
+    pte_t pte = pt[i];
+    if ((pte & PTE_V) == 0) continue;
+    if (pte_leaf(pte)) {
+      if (pte & PTE_U) free_leaf(pte, level);
+    } else if (level > 0) {
+      free_pt_level((pagetable_t)PTE2PA(pte), level - 1);
+      free_pt_page((pagetable_t)PTE2PA(pte));
+    }
+    pt[i] = 0;
+  }
+}
+
+//
+// count the user pages (PTE_U) mapped by a leaf, all those of a megapage. the zero page
+// costs nothing, and is not counted.
+//
+static int count_leaf(pte_t *pte, uint64 va, int level, void *n) {
+  if ((*pte & PTE_U) && !user_page_is_zero(PTE2PA(*pte))) *(uint64 *)n += 1L << (9 * level);
+  return 0;
+}
+
+//
+// the resident set size of a user page table, i.e., the number of user pages it maps.
+//
+uint64 user_vm_resident(pagetable_t page_dir) {
+  uint64 n = 0;
+  walk_range(page_dir, 0, MAXVA, count_leaf, &n);
+  return n;
+}
+
+// how user_vm_fork() passes a range on, see there
+typedef struct vm_fork_t {
+  pagetable_t *children;
+  int n;
+  int mode;
+} vm_fork;
+
+static int fork_leaf(pte_t *pte, uint64 va, int level, void *arg) {
+  vm_fork *f = arg;
+  uint64 size = 1L << PXSHIFT(level);
+
+  if (f->mode == VM_FORK_COW && (*pte & PTE_W)) *pte = (*pte & ~(PTE_W | PTE_D)) | PTE_COW;
+  for (int k = 0; k < f->n; k++) {
+    pte_t *child = level ? huge_walk(f->children[k], va, 1) : page_walk(f->children[k], va, 1);
+    if (!child) panic("fail to fork the page table.\n");
+    // whatever the child has mapped there (i.e., the top of its stack) is replaced
+    if (*child & PTE_V) {
+      if (!pte_leaf(*child)) panic("fail to fork the page table.\n");
+      free_leaf(*child, level);
+    }
+
+    if (f->mode == VM_FORK_COPY) {
+      void *pa = level ? alloc_huge_page() : alloc_page();
+      if (!pa) panic("out of memory on fork.\n");
+      memcpy(pa, (void *)PTE2PA(*pte), size);
+      // a private copy is writable, even if the original is shared copy-on-write
+      uint64 flags = PTE_FLAGS(*pte);
+      if (flags & PTE_COW) flags = (flags & ~PTE_COW) | PTE_W | PTE_D;
+      *child = PA2PTE(pa) | flags;
+    } else {
+      if (level) huge_page_ref_inc((void *)PTE2PA(*pte));
+      else page_ref_inc((void *)PTE2PA(*pte));
+      *child = *pte;
+    }
+  }
+  return 0;
+}
+
+//
+// pass the pages mapped in [va, va + size) of user page table page_dir on to each of the
+// n page tables in children[] (of forked children), in one walk: the pages are copied
+// (VM_FORK_COPY), or shared as they are (VM_FORK_SHARE), or shared copy-on-write
+// (VM_FORK_COW), i.e., the writable ones are made copy-on-write in page_dir as well.
+// megapages are passed on as a whole. a page a child has mapped already is replaced.
+//
+void user_vm_fork(pagetable_t page_dir, pagetable_t children[], int n, uint64 va, uint64 size,
+                  int mode) {
+  vm_fork f = {children, n, mode};
+  if (walk_range(page_dir, va, va + size, fork_leaf, &f) != 0)
+    panic("no memory to split a megapage.\n");
+}
+
+//
+// tear down a user page table: free all the user pages it maps, the page tables and the
+// page directory itself.
+//
+void user_vm_teardown(pagetable_t page_dir) {
+  free_pt_level(page_dir, 2);
+  free_pt_page(page_dir);
+}
+
+//
+// a private (i.e., user writable, or copy-on-write already) data page, which may be shared
+// copy-on-write. returns its pte, or NULL if va is not mapped to such a page.
+//
+static pte_t *user_data_pte(pagetable_t page_dir, uint64 va) {
+  pte_t *pte = page_walk(page_dir, va, 0);
+  if (pte == 0 || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U) || (*pte & (PTE_X | PTE_SHARED)))
+    return 0;
+  if ((*pte & (PTE_W | PTE_COW)) == 0) return 0;
+  return pte;
+}
+
+//
+// share the data page at user address va copy-on-write. a reference to the page is taken
+// for the caller. returns the physical address of the page, or 0 if va is not mapped to a
+// private data page.
+//
+uint64 user_page_share(pagetable_t page_dir, uint64 va) {
+  pte_t *pte = user_data_pte(page_dir, va);
+  if (pte == 0) return 0;
+
+  *pte = (*pte & ~(PTE_W | PTE_D)) | PTE_COW;
+  page_ref_inc((void *)PTE2PA(*pte));
+  return PTE2PA(*pte);
+}
+
+//
+// put the page at pa (whose reference is handed over) at user address va, in place of the
+// data page mapped there, which is released. the page is mapped copy-on-write, as it may
+// be shared. returns 0, or -1 (keeping the reference) if va is not mapped to a data page.
+//
+int user_page_install(pagetable_t page_dir, uint64 va, uint64 pa) {
+  pte_t *pte = user_data_pte(page_dir, va);
+  // the page is replaced, i.e., written to
+  if (pte == 0 || (!(*pte & PTE_W) && !user_region_writable(page_dir, va))) return -1;
+
+  free_page((void *)PTE2PA(*pte));
+  *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~(PTE_W | PTE_D)) | PTE_COW;
+  return 0;
+}
+
+//
+// handle a store to a copy-on-write page (or megapage) at user address va. returns 0 if done, or -1 if
+// it is not a copy-on-write fault.
+//
+int user_cow_fault(pagetable_t page_dir, uint64 va) {
+  int level;
+  pte_t *pte = leaf_walk(page_dir, va, &level);
+  if (pte == 0 || (*pte & PTE_COW) == 0) return -1;
+  if (level > 0) {
+    // a megapage nobody else maps any more is made writable as a whole. otherwise it is
+    // split, and only the page of va is copied.
+    if (huge_page_ref_count((void *)PTE2PA(*pte)) == 1) {
+      *pte = (*pte & ~PTE_COW) | PTE_W | PTE_D;
+      return 0;
+    }
+    if ((pte = page_walk(page_dir, va, 0)) == 0) return -1;
+  }
+  return cow_break(pte);
 }
 
 //
@@ -197,16 +652,19 @@ void user_vm_unmap(pagetable_t page_dir, uint64 va, uint64 size, int free) {
 //
 void print_proc_vmspace(process* proc) {
   sprint( "======\tbelow is the vm space of process%d\t========\n", proc->pid );
-  for( int i=0; i<proc->total_mapped_region; i++ ){
-    sprint( "-va:%lx, npage:%d, ", proc->mapped_info[i].va, proc->mapped_info[i].npages);
-    switch(proc->mapped_info[i].seg_type){
+  for( mapped_region* r = next_mapped_region(proc, 0); r; r = next_mapped_region(proc, r->va + 1) ){
+    sprint( "-va:%lx, npage:%d, ", r->va, r->npages);
+    switch(r->seg_type){
       case CODE_SEGMENT: sprint( "type: CODE SEGMENT" ); break;
       case DATA_SEGMENT: sprint( "type: DATA SEGMENT" ); break;
       case STACK_SEGMENT: sprint( "type: STACK SEGMENT" ); break;
       case CONTEXT_SEGMENT: sprint( "type: TRAPFRAME SEGMENT" ); break;
       case SYSTEM_SEGMENT: sprint( "type: USER KERNEL STACK SEGMENT" ); break;
+      case SHARED_SEGMENT: sprint( "type: SHARED SEGMENT" ); break;
+      case HEAP_SEGMENT: sprint( "type: HEAP SEGMENT" ); break;
+      case MMAP_SEGMENT: sprint( "type: MMAP SEGMENT" ); break;
     }
-    sprint( ", mapped to pa:%lx\n", lookup_pa(proc->pagetable, proc->mapped_info[i].va) );
+    sprint( ", mapped to pa:%lx\n", lookup_pa(proc->pagetable, r->va) );
   }
 
 }
@@ -14,8 +14,19 @@ enum VMPermision {
   PROT_EXEC = 4,
 };
 
+// a user page shared copy-on-write: mapped read-only, and copied at the first store.
+// uses one of the PTE bits reserved for software.
+#define PTE_COW (1L << 8)
+// a user page shared on purpose (e.g., shared memory), never turned into copy-on-write.
+#define PTE_SHARED (1L << 9)
+
 uint64 prot_to_type(int prot, int user);
 pte_t *page_walk(pagetable_t pagetable, uint64 va, int alloc);
+pte_t *leaf_walk(pagetable_t pagetable, uint64 va, int *level);
+pte_t *huge_walk(pagetable_t pagetable, uint64 va, int alloc);
+// called on each leaf PTE by walk_range(), with the address and level it maps at
+typedef int (*pte_visitor)(pte_t *pte, uint64 va, int level, void *arg);
+int walk_range(pagetable_t pagetable, uint64 va, uint64 end, pte_visitor fn, void *arg);
 uint64 lookup_pa(pagetable_t pagetable, uint64 va);
 
 /* --- kernel page table --- */
@@ -29,8 +40,28 @@ void kern_vm_init(void);
 
 /* --- user page table --- */
 void *user_va_to_pa(pagetable_t page_dir, void *va);
+void *user_va_access(pagetable_t page_dir, uint64 va, int write);
 void user_vm_map(pagetable_t page_dir, uint64 va, uint64 size, uint64 pa, int perm);
-void user_vm_unmap(pagetable_t page_dir, uint64 va, uint64 size, int free);
+int user_vm_split(pagetable_t page_dir, uint64 va, uint64 end);
+int user_vm_unmap(pagetable_t page_dir, uint64 va, uint64 size, int free);
+void user_vm_teardown(pagetable_t page_dir);
+// how user_vm_fork() passes pages on: copied, shared, or shared copy-on-write
+enum vm_fork_modes {
+  VM_FORK_COPY,
+  VM_FORK_SHARE,
+  VM_FORK_COW,
+};
+void user_vm_fork(pagetable_t page_dir, pagetable_t children[], int n, uint64 va, uint64 size,
+                  int mode);
+uint64 user_vm_resident(pagetable_t page_dir);
+uint64 user_zero_page(void);
+int user_page_is_zero(uint64 pa);
+uint64 user_page_share(pagetable_t page_dir, uint64 va);
+int user_page_install(pagetable_t page_dir, uint64 va, uint64 pa);
+int user_cow_fault(pagetable_t page_dir, uint64 va);
+int copy_to_user(pagetable_t page_dir, uint64 va, const void *src, uint64 n);
+int copy_from_user(pagetable_t page_dir, void *dst, uint64 va, uint64 n);
+int copy_str_from_user(pagetable_t page_dir, char *dst, uint64 va, int max);
 void print_proc_vmspace(process* proc);
 
 #endif
@@ -0,0 +1,159 @@
+/*
+ * the zygote pool: processes that are allocated (alloc_process) and have the elf image
+ * mapped ahead of time, so that spawn() only needs to pass the arguments and put one
+ * of them into the ready queue.
+ *
+ * a pool is set up for an image the first time it is spawned successfully, and the pools
+ * are topped up in the background (on timer ticks, a process per tick), out of the
+ * critical path of spawn(). a pool is emptied when its elf has changed (see elf_image_get).
+ */
+
+#include "zygote.h"
+#include "elf.h"
+#include "sched.h"
+#include "string.h"
+#include "spike_interface/spike_utils.h"
+
+typedef struct zygote_pool_t {
+  char path[MAX_EXEC_PATH];  // the elf the pooled processes are made of, "" if unused
+  // the image (of the elf cache) the pooled processes are made of, and its mtime, as the
+  // cache slot may be reloaded with a newer version of the elf
+  elf_image *img;
+  uint64 mtime;
+  process *procs[ZYGOTE_POOL_SIZE];
+  int nprocs;
+} zygote_pool;
+
+static zygote_pool zygote_pools[ZYGOTE_MAX_IMAGES];
+// set when some pool is running short of processes
+static int zygote_need_refill;
+
+//
+// make a process of elf image img, ready to run except for its arguments. returns NULL if
+// there is no free process structure, or no memory for the image.
+//
+static process *zygote_make(elf_image *img)
+{
+  process *p = alloc_process();
+  if (!p) return NULL;
+  // take the process structure out of FREE state at once
+  p->status = POOLED;
+  if (elf_image_map(img, p) != 0) {
+    do_exit(p, -1);
+    return NULL;
+  }
+  return p;
+}
+
+//
+// returns the pool of the elf at path. a free pool is assigned to path if it has none
+// yet, unless "create" is not set or all pools are taken (then NULL is returned).
+//
+static zygote_pool *zygote_find(const char *path, int create)
+{
+  zygote_pool *unused = NULL;
+
+  for (int i = 0; i < ZYGOTE_MAX_IMAGES; i++) {
+    if (strcmp(zygote_pools[i].path, path) == 0) return &zygote_pools[i];
+    if (!unused && zygote_pools[i].path[0] == 0) unused = &zygote_pools[i];
+  }
+
+  if (!create || !unused || strlen(path) >= MAX_EXEC_PATH) return NULL;
+  strcpy(unused->path, path);
+  unused->img = NULL;
+  return unused;
+}
+
+//
+// reclaim the processes pooled in pool (they have never run).
+//
+static void zygote_drain(zygote_pool *pool)
+{
+  while (pool->nprocs > 0) do_exit(pool->procs[--pool->nprocs], -1);
+}
+
+//
+// make sure the processes pooled in pool are made of image img: those of an older image
+// are reclaimed.
+//
+static void zygote_check(zygote_pool *pool, elf_image *img)
+{
+  if (pool->img == img && pool->mtime == img->mtime) return;
+  zygote_drain(pool);
+  pool->img = img;
+  pool->mtime = img->mtime;
+}
+
+//
+// implements spawn syscall in kernel. a pooled process of the elf is handed out if there
+// is one, otherwise the child is made from scratch. argv (argc strings in kernel memory)
+// are passed to main() of the child. returns the pid of child, or -1 on failure.
+//
+int do_spawn(process *parent, const char *path, int argc, char *argv[])
+{
+  // a cached image costs no loading, but finds out whether the elf has changed
+  elf_image *img = elf_image_get(path);
+  if (!img) {
+    // the elf is gone (or broken), and so is its pool
+    zygote_pool *pool = zygote_find(path, 0);
+    if (pool) {
+      zygote_drain(pool);
+      pool->path[0] = 0;
+    }
+    return -1;
+  }
+
+  // a pool is taken only by an elf that can be loaded
+  zygote_pool *pool = zygote_find(path, 1);
+  process *child;
+  if (pool) zygote_check(pool, img);
+
+  if (pool && pool->nprocs > 0) {
+    child = pool->procs[--pool->nprocs];
+  } else {
+    sprint("spawn: no pooled process for %s, making one.\n", path);
+    if (!(child = zygote_make(img))) return -1;
+  }
+  // someone else will need one later, refill in the background.
+  if (pool) zygote_need_refill = 1;
+
+  if (setup_user_args(child, argc, argv) != 0) {
+    // the child has never run, keep it for the next spawn of the elf
+    if (pool && pool->nprocs < ZYGOTE_POOL_SIZE)
+      pool->procs[pool->nprocs++] = child;
+    else
+      do_exit(child, -1);
+    return -1;
+  }
+
+  add_child(parent, child);
+  insert_to_ready_queue(child);
+  sprint("process %d spawned %s as process %d.\n", parent->pid, path, child->pid);
+  return child->pid;
+}
+
+//
+// top the pools up to ZYGOTE_POOL_SIZE processes, called on timer ticks. a tick makes one
+// process at most, to keep the tick short. the pools are made of their images as they
+// are in the elf cache, so the refill does no host I/O: a changed elf is noticed by the
+// next spawn (see zygote_check), and a pool whose image has left the cache is topped up
+// only once a spawn has brought it back.
+//
+void zygote_refill()
+{
+  if (!zygote_need_refill) return;
+
+  for (int i = 0; i < ZYGOTE_MAX_IMAGES; i++) {
+    zygote_pool *pool = &zygote_pools[i];
+    elf_image *img = pool->img;
+    if (pool->path[0] == 0 || pool->nprocs == ZYGOTE_POOL_SIZE || !img ||
+        strcmp(img->path, pool->path) != 0 || img->mtime != pool->mtime)
+      continue;
+
+    // out of process structures or memory, a later tick tries again
+    process *p = zygote_make(img);
+    if (p) pool->procs[pool->nprocs++] = p;
+    return;
+  }
+  zygote_need_refill = 0;
+}
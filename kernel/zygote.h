@@ -0,0 +1,18 @@
+#ifndef _ZYGOTE_H_
+#define _ZYGOTE_H_
+
+#include "process.h"
+
+// number of pre-initialized processes kept for each image. the process table grows on
+// demand, so a pooled process only costs its memory: the copies of its data pages, its
+// stack, trapframe and page tables.
+#define ZYGOTE_POOL_SIZE 4
+// number of images that own a zygote pool
+#define ZYGOTE_MAX_IMAGES 4
+
+// start the elf at path in a new child of parent, returns the pid of the child
+int do_spawn(process *parent, const char *path, int argc, char *argv[]);
+// top the zygote pools up, called in the background (timer ticks)
+void zygote_refill();
+
+#endif
@@ -14,10 +14,65 @@
 #include "spike_interface/spike_utils.h"
 //#include "../kernel/config.h"
 
+// spike_files[] holds the first MAX_FILES file slots. once they are used up, more slots
+// are taken (a page at a time) from the page allocator registered by
+// spike_file_set_allocator(). free slots are kept in a free list. like the rest of this
+// file, the tables assume a single hart: the atomic_* helpers of atomic.h are plain
+// read-then-write sequences, not atomic read-modify-write instructions.
 #define MAX_FILES 128
-#define MAX_FDS 128
-static spike_file_t* spike_fds[MAX_FDS];
+#define FILE_CHUNK_SIZE 4096
+#define FILES_PER_CHUNK (FILE_CHUNK_SIZE / sizeof(spike_file_t))
+#define MAX_FILE_CHUNKS 64
+
+// the fd table is made of chunks of FDS_PER_CHUNK entries, the first one is static, others
+// are taken from the page allocator on demand. free fds are tracked by a two-level bitmap
+// (64 x 64 bits), so that a free fd is found by two find-first-set operations.
+#define FDS_PER_CHUNK 512
+#define MAX_FD_CHUNKS 8
+#define MAX_FDS (FDS_PER_CHUNK * MAX_FD_CHUNKS)
+#define FD_WORDS_PER_CHUNK (FDS_PER_CHUNK / 64)
+
+static spike_file_t* spike_fds0[FDS_PER_CHUNK];
+static spike_file_t** spike_fds[MAX_FD_CHUNKS] = {spike_fds0};
+static int nr_fd_chunks = 1;
+static uint64 fd_free_map[MAX_FDS / 64];  // bit set: the fd is free
+static uint64 fd_free_summary;            // bit i set: fd_free_map[i] has free fd(s)
+
 spike_file_t spike_files[MAX_FILES] = {[0 ... MAX_FILES - 1] = {-1, 0}};
+static spike_file_t* file_chunks[MAX_FILE_CHUNKS];
+static int nr_file_chunks;
+// head of the free slot list: the slot number + 1 of the first free slot, 0 if empty
+static uint32 free_file_head;
+
+static void* (*spike_page_alloc)(void);
+
+// position of the least significant set bit of a non-zero x (de Bruijn multiplication)
+static int ffs64(uint64 x) {
+  static const uint8 debruijn_pos[64] = {
+      0,  1,  48, 2,  57, 49, 28, 3,  61, 58, 50, 42, 38, 29, 17, 4,
+      62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+      63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+      46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9,  13, 8,  7,  6};
+  return debruijn_pos[((x & -x) * 0x03f79d71b4cb0a89ULL) >> 58];
+}
+
+static spike_file_t* file_of_slot(uint32 slot) {
+  if (slot < MAX_FILES) return &spike_files[slot];
+  slot -= MAX_FILES;
+  return &file_chunks[slot / FILES_PER_CHUNK][slot % FILES_PER_CHUNK];
+}
+
+// returns the entry of fd in the fd table, or NULL if fd is beyond the table
+static spike_file_t** fd_entry(int fd) {
+  if (fd < 0 || fd >= nr_fd_chunks * FDS_PER_CHUNK) return NULL;
+  return &spike_fds[fd / FDS_PER_CHUNK][fd % FDS_PER_CHUNK];
+}
+
+//
+// register the page allocator, which allows file slots and fds to grow beyond their
+// static tables. called by the kernel once its physical memory manager is up.
+//
+void spike_file_set_allocator(void* (*page_alloc)(void)) { spike_page_alloc = page_alloc; }
 
 void copy_stat(struct stat* dest_va, struct frontend_stat* src) {
   struct stat* dest = (struct stat*)dest_va;
@@ -44,11 +99,31 @@ int spike_file_stat(spike_file_t* f, struct stat* s) {
   return ret;
 }
 
+int spike_file_statat(int dirfd, const char* fn, struct stat* s) {
+  struct frontend_stat buf;
+  size_t fn_size = strlen(fn) + 1;
+  long ret = frontend_syscall(HTIFSYS_fstatat, dirfd, (uint64)fn, fn_size, (uint64)&buf, 0, 0, 0);
+  if (ret == 0) copy_stat(s, &buf);
+  return ret;
+}
+
+static void spike_file_put_free(spike_file_t* f) {
+  f->next_free = free_file_head;
+  free_file_head = f->slot + 1;
+}
+
+static void spike_fd_put_free(int fd) {
+  fd_free_map[fd / 64] |= 1ULL << (fd % 64);
+  fd_free_summary |= 1ULL << (fd / 64);
+}
+
 int spike_file_close(spike_file_t* f) {
   if (!f) return -1;
-  spike_file_t* old = atomic_cas(&spike_fds[f->kfd], f, 0);
+  spike_file_t** fde = fd_entry(f->kfd);
+  spike_file_t* old = fde ? atomic_cas(fde, f, 0) : 0;
   spike_file_decref(f);
   if (old != f) return -1;
+  spike_fd_put_free(f->kfd);
   spike_file_decref(f);
   return 0;
 }
@@ -60,6 +135,7 @@ void spike_file_decref(spike_file_t* f) {
     atomic_set(&f->refcnt, 0);
 
     frontend_syscall(HTIFSYS_close, kfd, 0, 0, 0, 0, 0, 0);
+    spike_file_put_free(f);
   }
 }
 
@@ -72,24 +148,72 @@ ssize_t spike_file_write(spike_file_t* f, const void* buf, size_t size) {
   return frontend_syscall(HTIFSYS_write, f->kfd, (uint64)buf, size, 0, 0, 0, 0);
 }
 
+//
+// take one more page of file slots from the page allocator. returns -1 if impossible.
+//
+static int spike_file_grow(void) {
+  if (!spike_page_alloc || nr_file_chunks >= MAX_FILE_CHUNKS) return -1;
+  spike_file_t* chunk = (spike_file_t*)spike_page_alloc();
+  if (!chunk) return -1;
+
+  uint32 base = MAX_FILES + nr_file_chunks * FILES_PER_CHUNK;
+  file_chunks[nr_file_chunks++] = chunk;
+  for (int i = FILES_PER_CHUNK - 1; i >= 0; i--) {
+    chunk[i].kfd = -1;
+    chunk[i].refcnt = 0;
+    chunk[i].slot = base + i;
+    spike_file_put_free(&chunk[i]);
+  }
+  return 0;
+}
+
 static spike_file_t* spike_file_get_free(void) {
-  for (spike_file_t* f = spike_files; f < spike_files + MAX_FILES; f++)
-    if (atomic_read(&f->refcnt) == 0 && atomic_cas(&f->refcnt, 0, INIT_FILE_REF) == 0)
-      return f;
-  return NULL;
+  if (free_file_head == 0 && spike_file_grow() != 0) return NULL;
+  spike_file_t* f = file_of_slot(free_file_head - 1);
+  free_file_head = f->next_free;
+  atomic_set(&f->refcnt, INIT_FILE_REF);
+  return f;
+}
+
+//
+// take one more chunk of fds from the page allocator. returns -1 if impossible.
+//
+static int spike_fd_grow(void) {
+  if (!spike_page_alloc || nr_fd_chunks >= MAX_FD_CHUNKS ||
+      !(spike_fds[nr_fd_chunks] = (spike_file_t**)spike_page_alloc()))
+    return -1;
+
+  memset(spike_fds[nr_fd_chunks], 0, FDS_PER_CHUNK * sizeof(spike_file_t*));
+  int first_word = nr_fd_chunks++ * FD_WORDS_PER_CHUNK;
+  for (int i = 0; i < FD_WORDS_PER_CHUNK; i++) fd_free_map[first_word + i] = -1ULL;
+  fd_free_summary |= ((1ULL << FD_WORDS_PER_CHUNK) - 1) << first_word;
+  return 0;
 }
 
 int spike_file_dup(spike_file_t* f) {
-  for (int i = 0; i < MAX_FDS; i++) {
-    if (atomic_cas(&spike_fds[i], 0, f) == 0) {
-      spike_file_incref(f);
-      return i;
-    }
-  }
-  return -1;
+  if (fd_free_summary == 0 && spike_fd_grow() != 0) return -1;
+
+  // a bit of the summary is set as long as its word has free fds
+  int w = ffs64(fd_free_summary);
+  int b = ffs64(fd_free_map[w]);
+  fd_free_map[w] &= ~(1ULL << b);
+  if (fd_free_map[w] == 0) fd_free_summary &= ~(1ULL << w);
+
+  int fd = w * 64 + b;
+  *fd_entry(fd) = f;
+  spike_file_incref(f);
+  return fd;
 }
 
 void spike_file_init(void) {
+  // chain up the static file slots, slot 0 on top
+  for (int i = MAX_FILES - 1; i >= 0; i--) {
+    spike_files[i].slot = i;
+    spike_file_put_free(&spike_files[i]);
+  }
+  for (int i = 0; i < FD_WORDS_PER_CHUNK; i++) fd_free_map[i] = -1ULL;
+  fd_free_summary = (1ULL << FD_WORDS_PER_CHUNK) - 1;
+
   // create stdin, stdout, stderr and FDs 0-2
   for (int i = 0; i < 3; i++) {
     spike_file_t* f = spike_file_get_free();
@@ -9,6 +9,8 @@
 typedef struct file {
   int kfd;  // file descriptor of the host file
   uint32 refcnt;
+  uint32 slot;       // index of this file slot
+  uint32 next_free;  // next free slot (number + 1) in the free list, 0 ends the list
 } spike_file_t;
 
 extern spike_file_t spike_files[];
@@ -60,5 +62,7 @@ void spike_file_init(void);
 int spike_file_dup(spike_file_t* f);
 int spike_file_truncate(spike_file_t* f, off_t len);
 int spike_file_stat(spike_file_t* f, struct stat* s);
+int spike_file_statat(int dirfd, const char* fn, struct stat* s);
+void spike_file_set_allocator(void* (*page_alloc)(void));
 
 #endif
@@ -57,6 +57,208 @@ void* naive_malloc() {
   return (void*)do_user_call(SYS_user_allocate_page, 0, 0, 0, 0, 0, 0, 0);
 }
 
+//
+// lib call to sbrk. moves the end of heap by incr bytes, and returns the old end, or
+// (void*)-1 on failure. the new heap pages are zero-filled at their first touch.
+//
+void* sbrk(long incr) {
+  return (void*)(long)do_user_call(SYS_user_sbrk, incr, 0, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to stack_limit. sets the number of pages the stack may grow to (unless npages
+// is 0), and returns the old limit, or -1 if the stack can not be limited so.
+//
+int stack_limit(int npages) {
+  return do_user_call(SYS_user_stack_limit, npages, 0, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to mmap. maps len bytes of zero-filled memory at addr (or where the kernel
+// chooses, if addr is NULL) with protection prot. the pages are faulted in at first touch,
+// unless MAP_POPULATE is in flags. returns the address, or MAP_FAILED.
+//
+void* mmap(void* addr, uint64 len, int prot, int flags) {
+  return (void*)do_user_call(SYS_user_mmap, (uint64)addr, len, prot, flags, 0, 0, 0);
+}
+
+//
+// lib call to munmap. unmaps (and frees) the mmap memory in [addr, addr + len).
+//
+int munmap(void* addr, uint64 len) {
+  return do_user_call(SYS_user_munmap, (uint64)addr, len, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to mprotect. sets the protection of the mmap memory in [addr, addr + len).
+//
+int mprotect(void* addr, uint64 len, int prot) {
+  return do_user_call(SYS_user_mprotect, (uint64)addr, len, prot, 0, 0, 0, 0);
+}
+
+//
+// lib call to madvise. tells the kernel how the memory in [addr, addr + len) (heap, stack
+// or mmap) is going to be used: MADV_WILLNEED faults it in now, MADV_DONTNEED gives its
+// pages back (they read as zeroes afterwards), MADV_SEQUENTIAL/RANDOM/NORMAL tune how
+// many pages each fault maps, and MADV_HUGEPAGE/NOHUGEPAGE let (or keep) the kernel map
+// aligned 2MB blocks by megapages.
+//
+int madvise(void* addr, uint64 len, int advice) {
+  return do_user_call(SYS_user_madvise, (uint64)addr, len, advice, 0, 0, 0, 0);
+}
+
+//
+// lib call to rss. returns the number of pages resident in the address space of caller.
+//
+int rss() {
+  return do_user_call(SYS_user_rss, 0, 0, 0, 0, 0, 0, 0);
+}
+
+//
+// malloc/free: a size-class allocator on the heap (see sbrk).
+// small blocks (up to MALLOC_SMALL_MAX bytes) are served from pages dedicated to one size
+// class each: a freed block goes to the free list of its class, and a class takes a new
+// page (carved by a bump pointer) only when its free list is empty. larger blocks take
+// runs of whole pages, which are kept for reuse when freed. pages are taken from an arena
+// grown by MALLOC_CHUNK_PAGES pages per sbrk, which the kernel fills on first touch. so,
+// most calls take no syscall, and untouched memory costs no physical page. blocks of
+// MALLOC_MMAP_MIN bytes or more are mapped by mmap of their own, and unmapped when freed.
+// note: not thread-safe, threads sharing the heap should serialize the calls (mutex_t).
+//
+#define MALLOC_PAGE 4096
+#define MALLOC_ALIGN 16
+#define MALLOC_SMALL_MAX 1024
+#define MALLOC_CHUNK_PAGES 64
+#define MALLOC_LARGE_CLASS 0xff
+#define MALLOC_MMAP_MIN (256 * 1024)
+#define MALLOC_MMAP_CLASS 0xfe
+
+// header at the start of each page of small blocks, or of each run of pages of a large
+// block. the header of a block is found by rounding its address down to a page.
+typedef struct malloc_page_t {
+  uint32 cls;                  // size class, or MALLOC_LARGE_CLASS/MALLOC_MMAP_CLASS
+  uint32 npages;               // length of run (large blocks)
+  struct malloc_page_t *next;  // next free run (large blocks)
+} malloc_page;
+
+typedef struct malloc_block_t {
+  struct malloc_block_t *next;
+} malloc_block;
+
+static const uint16 malloc_class_size[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+#define MALLOC_NCLASSES (sizeof(malloc_class_size) / sizeof(malloc_class_size[0]))
+
+// size class of each small size, in units of MALLOC_ALIGN
+static uint8 malloc_class_of[MALLOC_SMALL_MAX / MALLOC_ALIGN + 1];
+static struct {
+  malloc_block *free;
+  char *bump, *bump_end;
+} malloc_classes[MALLOC_NCLASSES];
+static malloc_page *malloc_large_free;
+static char *malloc_arena, *malloc_arena_end;
+static int malloc_ready;
+
+static void malloc_init() {
+  int c = 0;
+  malloc_ready = 1;
+  for (int i = 0; i <= MALLOC_SMALL_MAX / MALLOC_ALIGN; i++) {
+    while (malloc_class_size[c] < i * MALLOC_ALIGN) c++;
+    malloc_class_of[i] = c;
+  }
+}
+
+//
+// take npages pages from the arena, growing it if needed. returns NULL if out of memory.
+//
+static void *malloc_arena_pages(uint64 npages) {
+  uint64 size = npages * MALLOC_PAGE;
+  if (malloc_arena_end - malloc_arena < size) {
+    uint64 grow = size > MALLOC_CHUNK_PAGES * MALLOC_PAGE ? size : MALLOC_CHUNK_PAGES * MALLOC_PAGE;
+    char *top = sbrk(grow);
+    if (top == (char *)-1) return NULL;
+
+    uint64 pad = 0;
+    if (top != malloc_arena_end) {
+      // the first arena, or someone else has moved the break: start a new arena at a page
+      // boundary. the rest of the old one is left unused.
+      pad = -(uint64)top & (MALLOC_PAGE - 1);
+      if (pad && sbrk(pad) == (void *)-1) return NULL;
+      malloc_arena = top + pad;
+    }
+    malloc_arena_end = top + pad + grow;
+  }
+  void *p = malloc_arena;
+  malloc_arena += size;
+  return p;
+}
+
+void *malloc(uint64 size) {
+  if (!malloc_ready) malloc_init();
+  if (size == 0) size = 1;
+
+  if (size <= MALLOC_SMALL_MAX) {
+    int c = malloc_class_of[(size + MALLOC_ALIGN - 1) / MALLOC_ALIGN];
+    if (malloc_classes[c].free) {
+      malloc_block *b = malloc_classes[c].free;
+      malloc_classes[c].free = b->next;
+      return b;
+    }
+    if (malloc_classes[c].bump + malloc_class_size[c] > malloc_classes[c].bump_end) {
+      malloc_page *pg = malloc_arena_pages(1);
+      if (!pg) return NULL;
+      pg->cls = c;
+      pg->npages = 1;
+      malloc_classes[c].bump = (char *)pg + sizeof(malloc_page);
+      malloc_classes[c].bump_end = (char *)pg + MALLOC_PAGE;
+    }
+    void *p = malloc_classes[c].bump;
+    malloc_classes[c].bump += malloc_class_size[c];
+    return p;
+  }
+
+  uint32 npages = (size + sizeof(malloc_page) + MALLOC_PAGE - 1) / MALLOC_PAGE;
+  malloc_page *pg;
+  if (size >= MALLOC_MMAP_MIN) {
+    if ((pg = mmap(NULL, npages * MALLOC_PAGE, PROT_READ | PROT_WRITE, 0)) == MAP_FAILED)
+      return NULL;
+    pg->cls = MALLOC_MMAP_CLASS;
+    pg->npages = npages;
+    return pg + 1;
+  }
+
+  // a large block: first fit among the freed runs, the rest of a longer run stays free
+  for (malloc_page **pp = &malloc_large_free; (pg = *pp); pp = &pg->next) {
+    if (pg->npages < npages) continue;
+    if (pg->npages == npages) {
+      *pp = pg->next;
+    } else {
+      pg->npages -= npages;
+      pg = (malloc_page *)((char *)pg + pg->npages * MALLOC_PAGE);
+    }
+    break;
+  }
+  if (!pg && !(pg = malloc_arena_pages(npages))) return NULL;
+  pg->cls = MALLOC_LARGE_CLASS;
+  pg->npages = npages;
+  return pg + 1;
+}
+
+void free(void *ptr) {
+  if (!ptr) return;
+  malloc_page *pg = (malloc_page *)((uint64)ptr & ~(uint64)(MALLOC_PAGE - 1));
+
+  if (pg->cls == MALLOC_MMAP_CLASS) {
+    munmap(pg, pg->npages * MALLOC_PAGE);
+  } else if (pg->cls == MALLOC_LARGE_CLASS) {
+    pg->next = malloc_large_free;
+    malloc_large_free = pg;
+  } else {
+    malloc_block *b = ptr;
+    b->next = malloc_classes[pg->cls].free;
+    malloc_classes[pg->cls].free = b;
+  }
+}
+
 //
 // lib call to naive_free
 //
@@ -74,6 +276,300 @@ int wait(int pid){
   return do_user_call(SYS_user_wait, pid, 0, 0, 0, 0, 0, 0);
 }
 
+//
+// lib call to fork_n. forks count children in one syscall. returns the number of children
+// made in the parent, and 0 in each child, which finds its index (0 ... count-1) in *index.
+//
+int fork_n(int count, int *index) {
+  return do_user_call(SYS_user_fork_n, count, (uint64)index, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to wait_many. blocks till some child exits, then reaps every exited child (at
+// most max of them) into buf. returns the number of reaped children, -1 if there is none.
+//
+int wait_many(wait_status *buf, int max) {
+  return do_user_call(SYS_user_wait_many, (uint64)buf, max, 0, 0, 0, 0, 0);
+}
+
+//
+// where a thread starts: runs fn(arg), and exits with its return value.
+//
+static void thread_start(thread_fn fn, void *arg) {
+  exit(fn(arg));
+}
+
+//
+// lib call to thread_create. starts a thread running fn(arg) on the stack whose top is
+// at stack, in the address space of the caller. returns the tid of thread, or -1.
+//
+int thread_create(thread_fn fn, void *arg, void *stack) {
+  return do_user_call(SYS_user_thread_create, (uint64)thread_start, (uint64)fn, (uint64)arg,
+                      (uint64)stack, 0, 0, 0);
+}
+
+//
+// lib call to thread_join. waits for the thread of tid to exit, and gets its exit code
+// in *retval (if retval is not NULL). returns 0, or -1 on failure.
+//
+int thread_join(int tid, int *retval) {
+  return do_user_call(SYS_user_thread_join, tid, (uint64)retval, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to futex_wait. sleeps while *addr == expected, till futex_wake() on addr.
+// returns 0 when woken up, or -1 at once if *addr != expected.
+//
+int futex_wait(volatile int *addr, int expected) {
+  return do_user_call(SYS_user_futex_wait, (uint64)addr, expected, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to futex_wake. wakes up at most n sleepers on addr, returns how many are woken.
+//
+int futex_wake(volatile int *addr, int n) {
+  return do_user_call(SYS_user_futex_wake, (uint64)addr, n, 0, 0, 0, 0, 0);
+}
+
+//
+// mutex on futex. the state is 0 (unlocked), 1 (locked) or 2 (locked, and there may be
+// sleepers). the uncontended lock and unlock take no syscall.
+//
+void mutex_lock(mutex_t *m) {
+  int c = 0;
+  if (__atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  // contended: mark the mutex as having sleepers, and sleep till it is unlocked
+  if (c != 2) c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  while (c != 0) {
+    futex_wait(&m->state, 2);
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+int mutex_trylock(mutex_t *m) {
+  int c = 0;
+  return __atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+             ? 0 : -1;
+}
+
+void mutex_unlock(mutex_t *m) {
+  if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2) futex_wake(&m->state, 1);
+}
+
+//
+// condition variable on futex. seq is bumped on each signal, so that a waiter does not
+// sleep after a signal it should have seen. signalling takes no syscall if nobody waits.
+//
+void cond_wait(cond_t *cv, mutex_t *m) {
+  int seq = __atomic_load_n(&cv->seq, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&cv->waiters, 1, __ATOMIC_RELAXED);
+  mutex_unlock(m);
+  futex_wait(&cv->seq, seq);
+  __atomic_fetch_sub(&cv->waiters, 1, __ATOMIC_RELAXED);
+  mutex_lock(m);
+}
+
+void cond_signal(cond_t *cv) {
+  __atomic_fetch_add(&cv->seq, 1, __ATOMIC_RELEASE);
+  if (__atomic_load_n(&cv->waiters, __ATOMIC_RELAXED) > 0) futex_wake(&cv->seq, 1);
+}
+
+void cond_broadcast(cond_t *cv) {
+  __atomic_fetch_add(&cv->seq, 1, __ATOMIC_RELEASE);
+  if (__atomic_load_n(&cv->waiters, __ATOMIC_RELAXED) > 0) futex_wake(&cv->seq, 0x7fffffff);
+}
+
+//
+// lib call to pipe. fds[0] gets the read end, fds[1] gets the write end.
+//
+int pipe(int fds[2]) {
+  return do_user_call(SYS_user_pipe, (uint64)fds, 0, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to read. returns the number of bytes read (maybe less than n), 0 at the end of
+// file, or -1 on failure. page-aligned buffers of whole pages are filled without copying.
+//
+int read(int fd, void *buf, int n) {
+  return do_user_call(SYS_user_read, fd, (uint64)buf, n, 0, 0, 0, 0);
+}
+
+//
+// lib call to write. writes all n bytes (in several syscalls if the pipe fills up), and
+// returns n, or -1 on failure. page-aligned buffers of whole pages are sent without
+// copying.
+//
+int write(int fd, const void *buf, int n) {
+  int done = 0;
+  while (done < n) {
+    int r = do_user_call(SYS_user_write, fd, (uint64)buf + done, n - done, 0, 0, 0, 0);
+    if (r < 0) return -1;
+    done += r;
+  }
+  return done;
+}
+
+//
+// lib call to close.
+//
+int close(int fd) {
+  return do_user_call(SYS_user_close, fd, 0, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to shm_create. makes a shared memory segment of size bytes (zero filled), and
+// returns its id, or -1.
+//
+int shm_create(int size) {
+  return do_user_call(SYS_user_shm_create, size, 0, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to shm_attach. maps the segment of id at addr (a page-aligned address, or NULL
+// to let the kernel choose). returns where the segment is mapped, or NULL on failure.
+//
+void *shm_attach(int id, void *addr) {
+  return (void *)(uint64)do_user_call(SYS_user_shm_attach, id, (uint64)addr, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to shm_detach. unmaps the segment attached at addr.
+//
+int shm_detach(void *addr) {
+  return do_user_call(SYS_user_shm_detach, (uint64)addr, 0, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to chan_create. makes a channel, i.e., a message ring in a shared memory
+// segment. returns the id of segment (to be passed to chan_attach), or -1.
+//
+int chan_create() {
+  return do_user_call(SYS_user_chan_create, 0, 0, 0, 0, 0, 0, 0);
+}
+
+//
+// attach the channel of id (made by chan_create), returns NULL on failure.
+//
+chan_ring *chan_attach(int id) {
+  return (chan_ring *)shm_attach(id, NULL);
+}
+
+//
+// the ring is a bounded multi-producer queue, with one consumer. the slot at position pos
+// (i.e., slots[pos & mask]) has seq == pos when it is free for the sender of pos, and
+// seq == pos + 1 when it holds the message of pos. a sender takes a position by advancing
+// head. neither side traps, unless the other side sleeps.
+//
+
+//
+// send msg through ch, if the ring is not full. returns 0, or -1 if it is full.
+//
+int chan_try_send(chan_ring *ch, uint64 msg) {
+  uint64 pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+  for (;;) {
+    chan_slot *s = &ch->slots[pos & ch->mask];
+    int64 dif = (int64)__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (int64)pos;
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&ch->head, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        s->msg = msg;
+        __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+        return 0;
+      }
+      // another sender took pos, pos is reloaded by the failed exchange
+    } else if (dif < 0) {
+      // the slot still holds the message of the previous round
+      return -1;
+    } else {
+      pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+//
+// receive a message from ch to *msg, if the ring is not empty. returns 0, or -1 if it is
+// empty. there must be only one receiver.
+//
+int chan_try_recv(chan_ring *ch, uint64 *msg) {
+  uint64 pos = ch->tail;
+  chan_slot *s = &ch->slots[pos & ch->mask];
+  if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1) return -1;
+
+  *msg = s->msg;
+  // free the slot for the sender of the next round
+  __atomic_store_n(&s->seq, pos + ch->mask + 1, __ATOMIC_RELEASE);
+  ch->tail = pos + 1;
+  return 0;
+}
+
+//
+// send msg through ch, sleeps while the ring is full.
+//
+void chan_send(chan_ring *ch, uint64 msg) {
+  while (chan_try_send(ch, msg) != 0) {
+    int bell = __atomic_load_n(&ch->space_bell, __ATOMIC_ACQUIRE);
+    __atomic_fetch_add(&ch->senders_waiting, 1, __ATOMIC_SEQ_CST);
+    // the receiver may have made room before seeing us waiting, check again
+    if (chan_try_send(ch, msg) == 0) {
+      __atomic_fetch_sub(&ch->senders_waiting, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    futex_wait(&ch->space_bell, bell);
+    __atomic_fetch_sub(&ch->senders_waiting, 1, __ATOMIC_RELAXED);
+  }
+
+  // ring the doorbell, only if the receiver sleeps (or is going to)
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ch->receiver_waiting, __ATOMIC_RELAXED)) {
+    __atomic_fetch_add(&ch->data_bell, 1, __ATOMIC_RELEASE);
+    futex_wake(&ch->data_bell, 1);
+  }
+}
+
+//
+// receive a message from ch, sleeps while the ring is empty.
+//
+uint64 chan_recv(chan_ring *ch) {
+  uint64 msg;
+  while (chan_try_recv(ch, &msg) != 0) {
+    int bell = __atomic_load_n(&ch->data_bell, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ch->receiver_waiting, 1, __ATOMIC_SEQ_CST);
+    // a sender may have sent before seeing us waiting, check again
+    if (chan_try_recv(ch, &msg) == 0) {
+      __atomic_store_n(&ch->receiver_waiting, 0, __ATOMIC_RELAXED);
+      break;
+    }
+    futex_wait(&ch->data_bell, bell);
+    __atomic_store_n(&ch->receiver_waiting, 0, __ATOMIC_RELAXED);
+  }
+
+  // wake the senders up, only if some sleep on the full ring
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ch->senders_waiting, __ATOMIC_RELAXED) > 0) {
+    __atomic_fetch_add(&ch->space_bell, 1, __ATOMIC_RELEASE);
+    futex_wake(&ch->space_bell, 0x7fffffff);
+  }
+  return msg;
+}
+
+//
+// lib call to exec. argv is NULL-terminated, and may be NULL (then argv[0] is path).
+// returns only on failure.
+//
+int exec(const char *path, char *const argv[]) {
+  return do_user_call(SYS_user_exec, (uint64)path, (uint64)argv, 0, 0, 0, 0, 0);
+}
+
+//
+// lib call to spawn. starts the elf at path in a new child process, argv is as in exec.
+// returns the pid of the child, or -1 on failure.
+//
+int spawn(const char *path, char *const argv[]) {
+  return do_user_call(SYS_user_spawn, (uint64)path, (uint64)argv, 0, 0, 0, 0, 0);
+}
+
 //
 // lib call to yield
 //
@@ -2,10 +2,86 @@
  * header file to be used by applications.
  */
 
+#include "kernel/channel.h"
+
+// an entry of the wait_many() result
+typedef struct wait_status_t {
+  int pid;
+  int code;
+} wait_status;
+
+// a mutex, initialized by MUTEX_INITIALIZER (or zeroes)
+typedef struct mutex_t {
+  volatile int state;
+} mutex_t;
+#define MUTEX_INITIALIZER {0}
+
+// a condition variable, initialized by COND_INITIALIZER (or zeroes)
+typedef struct cond_t {
+  volatile int seq;
+  volatile int waiters;
+} cond_t;
+#define COND_INITIALIZER {0, 0}
+
+// the function a thread runs, its return value is the exit code of thread
+typedef int (*thread_fn)(void *arg);
+
+// protection and flags of mmap (as in kernel/vmm.h and kernel/mmap.h)
+#define PROT_NONE 0
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define PROT_EXEC 4
+#define MAP_POPULATE 0x1
+#define MAP_FAILED ((void*)-1)
+// advice of madvise (as in kernel/vma.h)
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+#define MADV_HUGEPAGE 5
+#define MADV_NOHUGEPAGE 6
+
 int printu(const char *s, ...);
 int exit(int code);
 void* naive_malloc();
 void naive_free(void* va);
+void* sbrk(long incr);
+int rss();
+int stack_limit(int npages);
+void* mmap(void* addr, uint64 len, int prot, int flags);
+int munmap(void* addr, uint64 len);
+int mprotect(void* addr, uint64 len, int prot);
+int madvise(void* addr, uint64 len, int advice);
+void* malloc(uint64 size);
+void free(void* ptr);
 int fork();
 int wait(int pid);
+int fork_n(int count, int *index);
+int wait_many(wait_status *buf, int max);
+int thread_create(thread_fn fn, void *arg, void *stack);
+int thread_join(int tid, int *retval);
+int futex_wait(volatile int *addr, int expected);
+int futex_wake(volatile int *addr, int n);
+void mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+void cond_wait(cond_t *cv, mutex_t *m);
+void cond_signal(cond_t *cv);
+void cond_broadcast(cond_t *cv);
+int pipe(int fds[2]);
+int read(int fd, void *buf, int n);
+int write(int fd, const void *buf, int n);
+int close(int fd);
+int shm_create(int size);
+void *shm_attach(int id, void *addr);
+int shm_detach(void *addr);
+int chan_create();
+chan_ring *chan_attach(int id);
+int chan_try_send(chan_ring *ch, uint64 msg);
+int chan_try_recv(chan_ring *ch, uint64 *msg);
+void chan_send(chan_ring *ch, uint64 msg);
+uint64 chan_recv(chan_ring *ch);
+int exec(const char *path, char *const argv[]);
+int spawn(const char *path, char *const argv[]);
 void yield();